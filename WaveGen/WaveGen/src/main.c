@@ -8,18 +8,59 @@
 #define F_CPU 16000000UL  // CPU speed
 #define READ 1
 #define WRITE 0
-#define ADDR 0x48  // temp sensor address
-#define BUFFER_SIZE 20  // uart buffer size
+#define TEMP_ADDR_FIRST 0x48  // temp sensor address range (A2:A0 pins)
+#define TEMP_ADDR_LAST 0x4F
+#define TEMP_SENSORS_MAX 8  // temp sensors polled
+#define TWI_TIMEOUT_US 5000  // longest wait for a blocking TWI job
+#define WDT_TIMEOUT WDTO_500MS  // longest the main loop may take to come round
+#define CAPTURE_SIZE 256  // ADC loopback samples per capture
+#define TX_BUFFER_SIZE 64  // uart transmit buffer size, a power of two
+#define RX_BUFFER_SIZE 64  // uart receive buffer size
+#define RX_STOP_FREE 32  // send XOFF when this much receive room is left
+#define RX_RESUME_FREE 48  // send XON again once this much room is free
+#define XON 0x11
+#define REPLY_TAG_MAX 4  // longest sequence tag, e.g. "#123"
+#define COMMAND_NAME_MAX 10  // longest command name + 1, e.g. "CONTINUEE"
+#define PARSE_VALUE_LIMIT 100000000L  // command values stay below 100000.000
+#define COMMAND_HASH_SIZE 32  // command_index slots, a power of two
+#define XOFF 0x13
+// #define UART_RTS_PORT PORTB  // optional RTS output, no pin is free on
+// #define UART_RTS_DDR DDRB    // the stock board (low = ready to receive)
+// #define UART_RTS_BIT PB6
+// #define SYNC_PORT PORTB  // optional output, high for one sample when the
+// #define SYNC_DDR DDRB    // SYNC! wave starts a period; no pin is free on
+// #define SYNC_BIT PB6     // the stock board either
+// #define TRIGGER_INT 0  // optional trigger input on INT0 (PD2) or INT1 (PD3),
+                          // taking that bit from wave 2
+// #define SAMPLE_CLOCK  // optional shared sample clock, out on OC0B (PD5) or
+                         // in on T0 (PD4), taking both bits from wave 2
+#define SAMPLE_ISR_BUDGET 320  // min cycles per sample (OCR0A = 39 @ 8 presc)
+#define SAMPLE_ISR_HEADROOM 2  // sample period / worst measured ISR length
+#define PLAN_MIN_RATE 20000  // slowest sample rate the planner considers
+#define PLAN_TOLERANCE_PPM 500  // frequency error accepted at the fastest rate
+#define EXACT_TOLERANCE_PPM 100  // error accepted for a period-exact buffer
+#define LFSR_TAPS 0xB400  // x^16 + x^14 + x^13 + x^11 + 1
+#define PINK_ROWS 7  // octaves summed for pink noise
+#define TICK_OCR 249  // Timer1 compare for a 1 ms tick (250*4 us)
+#define TEMP_LOG_TICK_MS 100  // temp log timestamps count 0.1 s
+#define TEMP_LOG_SIZE 32  // temperature records held in SRAM, a power of two
+// #define TEMP_LOG_EEPROM  // move records the SRAM log can not hold to EEPROM
+#define TEMP_LOG_EEPROM_SIZE 96  // temperature records held in EEPROM
 #define _ASSERT_ENABLE_
 
 
 #include <string.h>
+#include <stddef.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <float.h>
+#include <math.h>
 #include <avr/pgmspace.h>
+#include <avr/eeprom.h>
 #include <inttypes.h>
 #include <util/delay.h>
 #include <util/twi.h>
@@ -27,13 +68,30 @@
 
 #include "ASF/mega/utils/compiler.h"
 #include "./ring_buffer.h"
+#include "./ring_buffer_p2.h"
 #include "config/conf_uart.h"
 #include <util/setbaud.h>
 
+//  enable interrupts and sleep until one has run, the host emulator
+//  runs its clock here instead
+#ifndef HAL_IDLE
+#define HAL_IDLE() do { sleep_enable(); sei(); sleep_cpu(); sleep_disable(); \
+                   } while (0)
+#endif
+
 
 // wave types
 enum waveTypes{SINEWAVE = 1, SQUAREWAVE = 2 , TRIWAVE = 3, SAWWAVE = 4,
-RSAWWAVE = 5 };
+RSAWWAVE = 5, NOISEWAVE = 6, PINKWAVE = 7, PULSEWAVE = 8 };
+
+
+// noise generator state for one wave
+typedef struct {
+    uint16_t lfsr;  //  16 bit Galois LFSR, never 0
+    uint8_t count;  //  sample counter picking the pink row to refresh
+    uint8_t sum;  //  sum of the pink rows
+    uint8_t rows[PINK_ROWS];  //  pink rows, one per octave
+}Noise;
 
 
 // wave struct
@@ -42,10 +100,20 @@ typedef struct {
     float offset;
     int frequency;
     int wave_type;
+    int duty;  //  pulse duty cycle in 0.1 %
+    int sweep;  //  pulse duty sweep in 0.1 % per second
+    int dither;  //  1 to dither a table driven wave from 8.8 levels
 }Wave;
 
-//  Look up tables for the different waves
-uint8_t  sine_wave[256] = {
+//  a wave's output buffer; dithered waves keep 8.8 levels, one for each
+//  pair of indexes, in the same memory
+typedef union {
+    uint8_t codes[256];  //  port value for each index
+    uint16_t levels[128];  //  level for index i is levels[i >> 1]
+}WaveTable;
+
+//  Look up tables for the different waves, kept in flash
+const uint8_t sine_wave[256] PROGMEM = {
     0x80, 0x83, 0x86, 0x89, 0x8C, 0x90, 0x93, 0x96,
     0x99, 0x9C, 0x9F, 0xA2, 0xA5, 0xA8, 0xAB, 0xAE,
     0xB1, 0xB3, 0xB6, 0xB9, 0xBC, 0xBF, 0xC1, 0xC4,
@@ -80,7 +148,7 @@ uint8_t  sine_wave[256] = {
     0x67, 0x6A, 0x6D, 0x70, 0x74, 0x77, 0x7A, 0x7D
 };
 
-uint8_t  square_wave[256] = {
+const uint8_t square_wave[256] PROGMEM = {
     0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
     0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
     0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
@@ -115,7 +183,7 @@ uint8_t  square_wave[256] = {
     0x00, 0x00, 0x00, 0x00, 0x00, 0, 0, 125,
 };
 
-uint8_t triangle[256] =
+const uint8_t triangle[256] PROGMEM =
     {1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25,
     27, 29, 31, 33, 35, 37, 39, 41, 43, 45, 47, 49,
     51, 53, 55, 57, 59, 61, 63, 65, 67, 69, 71, 73,
@@ -141,7 +209,7 @@ uint8_t triangle[256] =
     39, 37, 35, 33, 31, 29, 27, 25, 23, 21, 19, 17, 15,
      13, 11, 9, 7, 5, 3, 1};
 
-uint8_t reverse_sawtooth[256] = {
+const uint8_t reverse_sawtooth[256] PROGMEM = {
     191, 125, 64, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13,
     14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24,
     25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35,
@@ -169,7 +237,7 @@ uint8_t reverse_sawtooth[256] = {
     237, 238, 239, 240, 241, 242, 243, 244, 245,
     246, 247, 248, 249, 250, 251, 252, 253, 254, 255};
 
-uint8_t sawtooth[256] = {
+const uint8_t sawtooth[256] PROGMEM = {
     255, 254, 253, 252, 251, 250, 249, 248, 247,
     246, 245, 244, 243, 242, 241, 240, 239, 238,
     237, 236, 235, 234, 233, 232, 231, 230, 229,
@@ -201,26 +269,59 @@ uint8_t sawtooth[256] = {
 
 
 //  the lookup table that is used to wave1
-uint8_t current_wave[256] = {0};
+WaveTable current_wave = {{0}};
 //  lookup table used for wave 2
-uint8_t current_2_wave[256] = {0};
+WaveTable current_2_wave = {{0}};
+
+//  DAC calibration, folded into the tables as they are rendered
+#define DAC_CAL_OFF 0  // codes go to the ladder as rendered
+#define DAC_CAL_GAIN 1  // corrected for the measured gain and offset
+#define DAC_CAL_TABLE 2  // looked up in the channel's correction table
+#define DAC_GAIN_MIN 500  // measured gains accepted, in thousandths
+#define DAC_GAIN_MAX 1500
+#define DAC_OFFSET_MAX 32000  // measured offsets accepted, thousandths of a code
+
+//  calibration of one channel, as measured on its ladder
+typedef struct {
+    uint8_t mode;  //  DAC_CAL_ mode
+    int16_t gain;  //  output per code, thousandths
+    int16_t offset;  //  output at code 0, thousandths of a code
+}DacCal;
+
+DacCal EEMEM dac_cal_ee[2];  //  wave 1 and wave 2 settings
+uint8_t EEMEM dac_table_ee[2][256];  //  code to write for each wanted code
+DacCal dac_cal[2];  //  dac_cal_ee, checked at start up
+float dac_scale[2];  //  gain correction, from dac_cal
+float dac_shift[2];  //  offset correction, from dac_cal
+uint8_t dac_upload_index[2] = {0};  //  table entry CV! writes next
 
 //  UART buffers
-uint8_t out_buffer[BUFFER_SIZE];
-uint8_t in_buffer[BUFFER_SIZE];
+uint8_t out_buffer[TX_BUFFER_SIZE];
+uint8_t in_buffer[RX_BUFFER_SIZE];
 
 // ack and err characters
 const char ack[] = "ACK\n";
 const char err[] = "ERR\n";
 
+//  error codes sent after ERR in tagged replies
+#define REPLY_ERR_COMMAND 1  // unknown command or wave number
+#define REPLY_ERR_VALUE 2  // value out of range
+#define REPLY_ERR_BUSY 3  // not possible yet, e.g. CAPR! before the capture ends
+#define REPLY_ERR_DEVICE 4  // the temperature sensor did not answer
+
 
 //  UART ring buffers
-struct ring_buffer ring_buffer_out;
+struct ring_buffer_p2 ring_buffer_out;
 struct ring_buffer ring_buffer_in;
 
+//  receive flow control, in band: every reply is printable text (binary
+//  frames go out in hex), so 0x11 and 0x13 on the line are always XON/XOFF
+volatile uint8_t rx_stopped = 0;  //  XOFF sent, host should be paused
+volatile uint8_t flow_char = 0;  //  XON/XOFF waiting to go out, 0 if none
+
 //  initiate the structs for the waves
-Wave waveOne = {1.5, 0, 100, SINEWAVE};
-Wave waveTwo = {1.5, 0, 200, SINEWAVE};
+Wave waveOne = {1.5, 0, 100, SINEWAVE, 500, 0, 0};
+Wave waveTwo = {1.5, 0, 200, SINEWAVE, 500, 0, 0};
 
 int scale = 15;  //  size of the wave scale where
 volatile uint8_t temp_c;  // temp representation of port c
@@ -235,6 +336,7 @@ volatile uint8_t wave_out_1 = 0;  //  value to be written to ports
 volatile int inverse_repeat_1;  //  indexes to skip (1/repeatcout)
 volatile int threshold_rep_1 = 0;  //  times to repeat index (out of 15)
 volatile int threshold_skip_1 = 0;  //  times to skip index (out of 15)
+volatile uint8_t period_last_1 = 0;  //  last index of a period-exact buffer
 
 
 //  wave two (W2) variables
@@ -247,45 +349,461 @@ volatile int sample_count_2 = 0;
 volatile int inverse_repeat_2;
 volatile int threshold_rep_2 = 0;
 volatile int threshold_skip_2 = 0;
+volatile uint8_t period_last_2 = 0;
+
+//  noise variables
+volatile uint8_t noise_type_1 = 0;  //  W1 noise type, 0 if table driven
+volatile uint8_t noise_type_2 = 0;  //  W2 noise type, 0 if table driven
+Noise noise_1 = {0xACE1};  //  W1 noise generator
+Noise noise_2 = {0x1D2B};  //  W2 noise generator
+
+//  pulse variables
+volatile uint8_t pulse_1 = 0;  //  W1 is a pulse wave
+volatile uint32_t pulse_phase_1 = 0;  //  W1 phase, a period is 2^32
+volatile uint32_t pulse_step_1 = 0;  //  W1 phase increment per sample
+volatile uint32_t pulse_duty_1 = 0;  //  W1 phase where the pulse ends
+volatile int32_t pulse_sweep_1 = 0;  //  W1 duty increment per sample
+volatile uint8_t pulse_2 = 0;
+volatile uint32_t pulse_phase_2 = 0;
+volatile uint32_t pulse_step_2 = 0;
+volatile uint32_t pulse_duty_2 = 0;
+volatile int32_t pulse_sweep_2 = 0;
+
+//  wave 2 bits on port D, less the trigger input if there is one
+#ifdef TRIGGER_INT
+#define TRIGGER_PIN (PD2 + TRIGGER_INT)
+#if TRIGGER_INT == 0
+#define TRIGGER_vect INT0_vect
+#else
+#define TRIGGER_vect INT1_vect
+#endif
+#define TRIGGER_PORTD (1 << TRIGGER_PIN)
+#else
+#define TRIGGER_PORTD 0
+#endif
+#ifdef SAMPLE_CLOCK
+#define CLOCK_PORTD ((1 << PD4) | (1 << PD5))  // T0 and OC0B
+#else
+#define CLOCK_PORTD 0
+#endif
+#define WAVE_2_PORTD (0b11111100 & ~(TRIGGER_PORTD | CLOCK_PORTD))
+
+//  sample clock variables
+#define CLOCK_FREE 0  // Timer0 runs at the rate the planner picks
+#define CLOCK_MASTER 1  // runs at CLKT! and sends its sample clock out
+#define CLOCK_SLAVE 2  // takes a sample on every rising edge from a master
+#define CLOCK_TOP_MIN (SAMPLE_ISR_BUDGET/8)  // shortest CLKT! sample period
+uint8_t clock_mode = CLOCK_FREE;  //  CLK! setting
+uint16_t clock_top = 45;  //  locked sample period, 0.5 us steps (44.4 kHz)
+bool phase_reset = false;  //  PHASE! restarts the waves at CONTINUEE!
+
+//  sync and trigger variables
+#define TRIGGER_OFF 0  // edges are ignored
+#define TRIGGER_RESET 1  // every edge restarts the waves from phase zero
+#define TRIGGER_START 2  // CONTINUEE! waits for an edge to start the output
+uint8_t trigger_mode = TRIGGER_OFF;  //  TRIG! setting
+volatile uint8_t sync_wave = 1;  //  wave whose period the sync pin marks, 0
+                                 //  for PHASE! restarts only
+uint8_t sync_index = 0;  //  its index at the last sample
+
+//  dither variables
+volatile uint8_t dither_1 = 0;  //  W1 plays 8.8 levels
+volatile uint8_t dither_error_1 = 0;  //  W1 fraction carried to the next sample
+volatile uint8_t dither_2 = 0;
+volatile uint8_t dither_error_2 = 0;
 
 //  general wave variables
-int sampling_frequency = 44500;  //  sampling rate
-int threshold_freq_int;  //  freq of lookup table traversal @ sampling rate
-float threshold_freq_float;  //  (float) freq of lookup table traversal @ sr
+uint16_t sampling_frequency = 44444;  //  sampling rate chosen by the planner
+uint8_t sample_clock_select = (1 << CS01);  //  Timer0 CS0x bits for the rate
+uint16_t sample_prescaler = 8;  //  Timer0 prescaler for the rate
+long wave_error_1 = 0;  //  predicted W1 frequency error (ppm)
+long wave_error_2 = 0;  //  predicted W2 frequency error (ppm)
+char wave_mode_1 = 'D';  //  W1 stepping mode, as in WaveSteps
+char wave_mode_2 = 'D';  //  W2 stepping mode, as in WaveSteps
+volatile uint8_t sample_isr_ticks = 0;  //  worst TCNT0 seen at ISR exit
+uint16_t sample_isr_cycles = 0;  //  worst measured sample ISR length (cycles)
+
+//  output state kept over a watchdog reset, the startup code does not
+//  clear .noinit so it lasts as long as the power does
+typedef struct {
+    Wave one;  //  waves the tables were last built from
+    Wave two;
+    uint16_t isr_cycles;  //  sample_isr_cycles, for the same sample rate
+    uint8_t clock_mode;  //  CLOCK_ role in a rig, so a slave stays locked
+    uint16_t clock_top;
+    uint8_t index_1;  //  phase when it was saved
+    uint8_t index_2;
+    uint32_t pulse_phase_1;
+    uint32_t pulse_phase_2;
+    uint32_t pulse_duty_1;
+    uint32_t pulse_duty_2;
+    Noise noise_1;
+    Noise noise_2;
+    uint16_t check;  //  StateCheck() of everything above
+}SavedState;
+
+SavedState saved __attribute__((section(".noinit")));
+uint8_t reset_cause = 0;  //  MCUSR at startup
+
+//  step values for one wave, as used by the sample interrupt
+typedef struct {
+    int repeat_count;  //  samples to hold each index (repeat mode)
+    int threshold_rep;  //  last sample_count holding repeat_count
+    int inverse_repeat;  //  indexes to advance per sample (skip mode)
+    int threshold_skip;  //  last sample_count advancing inverse_repeat
+    uint32_t phase_step;  //  phase increment per sample (pulse waves)
+    uint16_t period;  //  samples in a period-exact buffer, 0 if dithered
+    char mode;  //  'X' exact, 'D' dithered, 'P' pulse, 'N' noise
+} WaveSteps;
+
+//  Timer0 prescalers the planner may choose from, with their CS0x bits
+const uint16_t timer0_prescalers[] = {1, 8, 64};
+const uint8_t timer0_clock_selects[] = {(1 << CS00), (1 << CS01),
+                                        (1 << CS01) | (1 << CS00)};
+
+//  runtime performance counters, read with STATS! and cleared with STCLR!
+typedef struct {
+    uint16_t samples_low;  //  sample ISR runs, low word
+    uint16_t samples_high;  //  sample ISR runs, high word
+    uint16_t missed;  //  sample ISRs that overran the next compare match
+    uint16_t rx_drops;  //  bytes lost to a full UART receive buffer
+    uint8_t tx_high;  //  most bytes queued in the UART transmit buffer
+    uint16_t i2c_timeouts;  //  I2C waits that timed out
+    uint32_t render_us;  //  longest PopulateWaveTable, microseconds
+}Stats;
+
+volatile Stats stats = {0};
+
+//  one temperature log record, sent field by field by SendTempLog
+typedef struct {
+    uint16_t tick;  //  0.1 s steps (TEMP_LOG_TICK_MS) since reset, low word
+    int16_t reading;  //  temperature in 1/256 degC
+    uint8_t sensor;  //  index of the sensor in the SCAN! order
+}TempRecord;
+
+#define TEMP_LOG_HEADER_SIZE 12  // LOG! frame bytes ahead of the records
+#define TEMP_RECORD_SIZE 5  // LOG! frame bytes per record
+
+//  temperature log, drained with LOG!
+TempRecord temp_log[TEMP_LOG_SIZE];
+uint8_t temp_log_first = 0;  //  oldest record in temp_log
+uint8_t temp_log_count = 0;  //  records in temp_log
+uint16_t temp_log_lost = 0;  //  records overwritten before a download
+#ifdef TEMP_LOG_EEPROM
+TempRecord EEMEM temp_log_ee[TEMP_LOG_EEPROM_SIZE];
+uint8_t temp_log_ee_first = 0;  //  oldest record in temp_log_ee
+uint8_t temp_log_ee_count = 0;  //  records in temp_log_ee
+#endif
+
+//  main loop events, raised by the ISRs
+#define EVENT_TICK 0x01  // the 1 ms scheduler tick
+#define EVENT_TWI 0x02  // a TWI job finished
+volatile uint8_t events = 0;  //  EVENT_ bits not handled yet
+volatile uint32_t tick_ms = 0;  //  Timer1 ticks since reset
+
+//  scheduler tasks, run from the main loop on the 1 ms tick
+#define TASK_TEMP 0  // start a round of temp sensor reads
+#define TASK_TEMP_TIMEOUT 1  // give up on a temp sensor read
+#define TASKS 2
+
+//  a periodic or one-shot task
+typedef struct {
+    void (*run)(void);
+    char name[5];  //  reported by TASK!
+    bool hold;  //  held from the first command byte until CONTINUEE!
+    bool active;
+    uint16_t period;  //  ms between runs, 0 runs once
+    uint32_t due;  //  tick_ms of the next run
+    uint16_t runs;  //  runs since STCLR!
+    uint32_t total_us;  //  time spent running since STCLR!
+    uint32_t max_us;  //  longest run since STCLR!
+}Task;
+
+bool tasks_held = false;  //  hold tasks while commands arrive
 
 //  temp sensor variables
-volatile  one_second_counter = 0;  //  if one second has past since temp output
-int temperature_msb = 0;  //  value of temp reading
 int temp_display = 1;  //  if to display the temp value
-volatile int one_second_interrup = 0;  //  temp sensor time counter
+uint8_t temp_resolution = 12;  //  sensor resolution in bits, 9 to 12
+uint16_t temp_interval = 10;  //  0.1 s steps between readings
+uint8_t temp_average = 1;  //  rounds averaged into one sample
+uint8_t temp_rounds = 0;  //  rounds in temp_sum
+int32_t temp_sum[TEMP_SENSORS_MAX];  //  sum of the readings being averaged
+uint8_t temp_readings[TEMP_SENSORS_MAX];  //  good readings in temp_sum
+uint8_t temp_sensor_addr[TEMP_SENSORS_MAX];  //  sensors found by I2cScan
+uint8_t temp_sensor_count = 0;  //  entries in temp_sensor_addr
+uint8_t temp_poll_index = 0;  //  sensor being read, count when idle
+
+//  ADC loopback capture, started with CAPT! and read with CAPR!/CAPD!
+#define CAPTURE_IDLE 0
+#define CAPTURE_RUNNING 1
+#define CAPTURE_DONE 2
+
+//  results of CaptureMeasure
+typedef struct {
+    uint8_t min;
+    uint8_t max;
+    uint8_t mean;
+    uint32_t period_us;  //  0 if fewer than two periods were seen
+}CaptureReport;
+
+uint8_t capture_buffer[CAPTURE_SIZE];
+volatile uint16_t capture_count = 0;  //  samples in capture_buffer
+volatile uint8_t capture_state = CAPTURE_IDLE;
+uint8_t capture_channel = 0;  //  ADC channel being captured
+
+//  I2C bus
+#define TWI_BUSY 0
+#define TWI_DONE 1
+#define TWI_FAILED 2
+#define TWI_TIMEOUT 3  // abandoned by TwiReset
+
+//  one write-then-read transfer run by the TWI interrupt
+typedef struct {
+    uint8_t addr;  //  7 bit device address
+    uint8_t write_len;  //  bytes in write
+    uint8_t read_len;  //  bytes wanted in read
+    uint8_t index;  //  bytes written, then bytes read
+    uint8_t write[2];
+    uint8_t read[2];
+    volatile uint8_t status;  //  TWI_BUSY, TWI_DONE, TWI_FAILED or TWI_TIMEOUT
+}TwiJob;
+
+TwiJob twi_job = {0, 0, 0, 0, {0}, {0}, TWI_DONE};
+uint8_t i2c_devices[16];  //  one bit per address that answered the scan
+
+//  command parser states
+#define PARSE_NAME 0  // command name, e.g. "AM1 " or "CONTINUEE"
+#define PARSE_TAG 1  // "#<seq>" ahead of the name
+#define PARSE_VALUE 2  // sign and whole digits of the value
+#define PARSE_FRACTION 3  // digits after the decimal point
+#define PARSE_ERROR 4  // bad command, wait for the '!'
+
+//  a command being received, decoded a byte at a time
+typedef struct {
+    char name[COMMAND_NAME_MAX];  //  zero padded
+    uint8_t name_len;
+    uint8_t state;  //  PARSE_NAME to PARSE_ERROR
+    uint8_t error;  //  REPLY_ERR_ code once in PARSE_ERROR
+    bool has_sign;
+    bool negative;
+    bool has_value;  //  at least one digit arrived
+    uint8_t fraction_digits;
+    int32_t value;  //  magnitude of the value in thousandths
+}Command;
+
+//  command table flags
+#define COMMAND_WAVE 0x01  // the wave number follows the opcode, "AM1"
+#define COMMAND_VALUE 0x02  // the value may not be left out
+#define COMMAND_INT 0x04  // whole numbers, the fraction is dropped
+#define COMMAND_ACK 0x08  // ACK once set, else the setter asks for a reply
+#define COMMAND_REBUILD 0x10  // rebuild the wave tables before the ACK
+
+//  runs a command once its value is in range, returns a REPLY_ERR_ code
+typedef uint8_t (*CommandSetter)(Wave *wave, uint8_t field, long value);
+
+//  one command, kept in flash
+typedef struct {
+    char name[COMMAND_NAME_MAX];  //  opcode is the first two letters
+    uint8_t flags;  //  COMMAND_ flags
+    uint8_t field;  //  Wave member the setter writes, or setter specific
+    int32_t min;  //  value range in thousandths
+    int32_t max;
+    CommandSetter set;
+}CommandEntry;
 
 //  serial variables
 uint8_t recieved_byte;  //  byte received over uart
-char recieved_string[12] = {0};  //  stores instructions recieved
-int recieved_string_index = 0;  //  current index in the received_string buffer
-int format_error = 0;  //  send ERR string
+Command command;  //  command being received
+uint8_t command_index[COMMAND_HASH_SIZE];  //  commands entry + 1 by opcode
+int format_error = 0;  //  send ERR string, the REPLY_ERR_ code
+char reply_tag[REPLY_TAG_MAX];  //  "#<seq>" ahead of a tagged command
+uint8_t reply_tag_len = 0;  //  0 for an untagged command
 int send_ack = 0;  //  send ACK string
 int continuee = 0;  //  continue processing the waves (enable interrupt)
+int send_rate = 0;  //  send the sample rate report
+int rebuild_waves = 0;  //  wave tables and sample rate need updating
+int send_stats = 0;  //  send the performance counters
+int send_tasks = 0;  //  send the task run times
+int send_log = 0;  //  send the temperature log
+int send_scan = 0;  //  rescan the I2C bus and send the devices found
+int send_capture = 0;  //  send the capture measurements
+int send_capture_data = 0;  //  send the raw capture buffer
+int send_dac = 0;  //  send the calibration of this wave, 0 for none
 
 
 //  function defines
 void I2cInit(void);
-void GetTemp(unsigned char addr);
+void I2cScan(void);
+void TwiStart(uint8_t addr, const uint8_t *data, uint8_t write_len,
+              uint8_t read_len);
+bool TwiBusy(void);
+void TwiReset(void);
+int TwiRun(uint8_t addr, const uint8_t *data, uint8_t write_len,
+           uint8_t read_len);
+void TempPollStart(void);
+void TempPoll(void);
+void TempPollWait(void);
+void TempPollTimeout(void);
+void TempRoundDone(void);
+void TempResetAverage(void);
+uint8_t TempFormat(char *line, uint8_t len, int16_t reading);
+int TempSetResolution(uint8_t bits);
+void TempLogAdd(uint8_t sensor, int16_t reading);
+void CaptureStart(uint8_t channel);
+void CaptureMeasure(CaptureReport *report);
+void SendTempLog(void);
+static void SendTempRecord(const TempRecord *record);
+uint32_t TickMs(void);
+uint32_t TickMicros(void);
+void TaskStart(uint8_t task, uint16_t delay, uint16_t period);
+void TaskStop(uint8_t task);
+void TaskRunDue(void);
 static void UartInit(void);
-static inline void UartPutChar(uint8_t data);
+static uint8_t UartWrite(const void *data, uint8_t len);
+static void UartWriteAll(const void *data, uint8_t len);
 static inline uint8_t UartGetChar(void);
 static inline bool UartCharWaiting(void);
-int StartSend(void);
-void StopSend(void);
-int ControlSend(int read, unsigned char addr);
-int DataSend(int data);
-unsigned char DataGet(unsigned char last);
+static inline uint8_t UartRxFree(void);
 void InterruptInit(void);
 void WaveInit(void);
+void WatchdogInit(void);
+static inline void WatchdogFeed(void);
+uint16_t StateCheck(void);
+void StateSavePhase(void);
+void StateSave(void);
+bool StateRestore(void);
+void StateRestorePhase(void);
 void ClearReceiveBuffer(void);
+static bool ParseByte(uint8_t byte);
+void CommandInit(void);
+static uint8_t CommandHash(char first, char second);
+static uint8_t RunCommand(void);
+static uint8_t SetWaveFloat(Wave *wave, uint8_t field, long value);
+static uint8_t SetWaveInt(Wave *wave, uint8_t field, long value);
+static uint8_t SetDuty(Wave *wave, uint8_t field, long value);
+static uint8_t SetSweep(Wave *wave, uint8_t field, long value);
+static uint8_t SetContinue(Wave *wave, uint8_t field, long value);
+static uint8_t SetSendRate(Wave *wave, uint8_t field, long value);
+static uint8_t SetSendStats(Wave *wave, uint8_t field, long value);
+static uint8_t SetSendTasks(Wave *wave, uint8_t field, long value);
+static uint8_t SetClearStats(Wave *wave, uint8_t field, long value);
+static uint8_t SetTempResolution(Wave *wave, uint8_t field, long value);
+static uint8_t SetTempInterval(Wave *wave, uint8_t field, long value);
+static uint8_t SetTempAverage(Wave *wave, uint8_t field, long value);
+static uint8_t SetSendLog(Wave *wave, uint8_t field, long value);
+static uint8_t SetSendScan(Wave *wave, uint8_t field, long value);
+static uint8_t SetCapture(Wave *wave, uint8_t field, long value);
+static uint8_t SetSendCapture(Wave *wave, uint8_t field, long value);
 void SendReply(void);
+static void ReplyTag(void);
+static uint8_t ReplyText(char *reply, uint8_t len, const char *text);
+static uint8_t ReplyNumber(char *reply, uint8_t len, long value);
+static uint8_t FrameLittleEndian(uint8_t *frame, uint8_t len, uint32_t value,
+                                 uint8_t bytes);
+static void UartWriteHex(const uint8_t *data, uint8_t len);
+uint16_t SampleIsrCycles(void);
+static uint8_t TableSample(const uint8_t *table, uint16_t i,
+                           uint16_t length);
+float SampleRate(void);
+uint16_t ExactPeriod(float rate, int frequency);
+float PlanWaveSteps(float rate, const Wave *wave, WaveSteps *steps);
+int32_t PulseSweepStep(int sweep);
+void PlanSampleRate(void);
 void PopulateWaveTable(float Ampl, float offset,
-                        int frequency, int waveType, int WaveNo);
+                        int frequency, int waveType, int WaveNo, int dither);
+void DacCalInit(void);
+void DacCalUpdate(uint8_t channel);
+static uint8_t DacCode(uint8_t channel, float value);
+static uint16_t DacLevel(uint8_t channel, float value);
+uint16_t DacTableCheck(uint8_t channel);
+static uint8_t SetDacCal(Wave *wave, uint8_t field, long value);
+static uint8_t SetDacIndex(Wave *wave, uint8_t field, long value);
+static uint8_t SetDacEntry(Wave *wave, uint8_t field, long value);
+static uint8_t SetSendDac(Wave *wave, uint8_t field, long value);
+static inline void SampleOut(void);
+static inline void PhaseReset(void);
+static uint8_t SetPhase(Wave *wave, uint8_t field, long value);
+#ifdef SAMPLE_CLOCK
+void ClockInit(void);
+static uint8_t SetClock(Wave *wave, uint8_t field, long value);
+#endif
+#ifdef SYNC_PORT
+static uint8_t SetSync(Wave *wave, uint8_t field, long value);
+#endif
+#ifdef TRIGGER_INT
+void TriggerInit(void);
+static uint8_t SetTrigger(Wave *wave, uint8_t field, long value);
+#endif
+
+//  every command, looked up by RunCommand; ranges are in thousandths
+const CommandEntry commands[] PROGMEM = {
+    {"AM", COMMAND_WAVE | COMMAND_VALUE | COMMAND_ACK | COMMAND_REBUILD,
+     offsetof(Wave, amplitude), 0, 10000L, SetWaveFloat},
+    {"OF", COMMAND_WAVE | COMMAND_VALUE | COMMAND_ACK | COMMAND_REBUILD,
+     offsetof(Wave, offset), -10000L, 10000L, SetWaveFloat},
+    {"FR", COMMAND_WAVE | COMMAND_VALUE | COMMAND_INT | COMMAND_ACK |
+     COMMAND_REBUILD, offsetof(Wave, frequency), 1000L, 10000000L, SetWaveInt},
+    {"WA", COMMAND_WAVE | COMMAND_VALUE | COMMAND_INT | COMMAND_ACK |
+     COMMAND_REBUILD, offsetof(Wave, wave_type), 1000L, PULSEWAVE*1000L,
+     SetWaveInt},
+    {"DI", COMMAND_WAVE | COMMAND_VALUE | COMMAND_INT | COMMAND_ACK |
+     COMMAND_REBUILD, offsetof(Wave, dither), 0, 1000L, SetWaveInt},
+    {"DU", COMMAND_WAVE | COMMAND_VALUE | COMMAND_ACK, 0, 0, 100000L, SetDuty},
+    {"DS", COMMAND_WAVE | COMMAND_VALUE | COMMAND_ACK, 0, -1000000L, 1000000L,
+     SetSweep},
+    {"CONTINUEE", COMMAND_ACK, 0, 0, 0, SetContinue},
+    {"RATE", 0, 0, 0, 0, SetSendRate},
+    {"STATS", 0, 0, 0, 0, SetSendStats},
+    {"STCLR", COMMAND_ACK, 0, 0, 0, SetClearStats},
+    {"TRES", COMMAND_VALUE | COMMAND_INT | COMMAND_ACK, 0, 9000L, 12000L,
+     SetTempResolution},
+    {"TINT", COMMAND_VALUE | COMMAND_INT | COMMAND_ACK, 0, 1000L, 600000L,
+     SetTempInterval},
+    {"TAVG", COMMAND_VALUE | COMMAND_INT | COMMAND_ACK, 0, 1000L, 64000L,
+     SetTempAverage},
+    {"LOG", 0, 0, 0, 0, SetSendLog},
+    {"SCAN", 0, 0, 0, 0, SetSendScan},
+    {"CAPT", COMMAND_VALUE | COMMAND_INT | COMMAND_ACK, 0, 0, 7000L,
+     SetCapture},
+    {"CAPR", 0, 'R', 0, 0, SetSendCapture},
+    {"CAPD", 0, 'D', 0, 0, SetSendCapture},
+    {"TASK", 0, 0, 0, 0, SetSendTasks},
+    {"CM", COMMAND_WAVE | COMMAND_VALUE | COMMAND_INT | COMMAND_ACK |
+     COMMAND_REBUILD, 'M', 0, DAC_CAL_TABLE*1000L, SetDacCal},
+    {"GA", COMMAND_WAVE | COMMAND_VALUE | COMMAND_ACK | COMMAND_REBUILD, 'G',
+     DAC_GAIN_MIN, DAC_GAIN_MAX, SetDacCal},
+    {"OS", COMMAND_WAVE | COMMAND_VALUE | COMMAND_ACK | COMMAND_REBUILD, 'O',
+     -DAC_OFFSET_MAX, DAC_OFFSET_MAX, SetDacCal},
+    {"CI", COMMAND_WAVE | COMMAND_VALUE | COMMAND_INT | COMMAND_ACK, 0, 0,
+     255000L, SetDacIndex},
+    {"CV", COMMAND_WAVE | COMMAND_VALUE | COMMAND_INT | COMMAND_ACK, 0, 0,
+     255000L, SetDacEntry},
+    {"CK", COMMAND_WAVE, 0, 0, 0, SetSendDac},
+    {"PHASE", COMMAND_ACK, 0, 0, 0, SetPhase},
+#ifdef SYNC_PORT
+    {"SYNC", COMMAND_VALUE | COMMAND_INT | COMMAND_ACK, 0, 0, 2000L, SetSync},
+#endif
+#ifdef SAMPLE_CLOCK
+    {"CLK", COMMAND_VALUE | COMMAND_INT | COMMAND_ACK | COMMAND_REBUILD, 'M',
+     0, CLOCK_SLAVE*1000L, SetClock},
+    {"CLKT", COMMAND_VALUE | COMMAND_INT | COMMAND_ACK | COMMAND_REBUILD, 'T',
+     CLOCK_TOP_MIN*1000L, 256000L, SetClock},
+#endif
+#ifdef TRIGGER_INT
+    {"TRIG", COMMAND_VALUE | COMMAND_INT | COMMAND_ACK, 0, 0,
+     TRIGGER_START*1000L, SetTrigger},
+#endif
+};
+
+#define COMMAND_COUNT (sizeof(commands)/sizeof(commands[0]))
+_Static_assert(COMMAND_COUNT < COMMAND_HASH_SIZE,
+               "command_index needs a free slot to end a lookup");
+
+//  the scheduler's tasks, by TASK_ index
+Task tasks[TASKS] = {
+    {TempPollStart, "TEMP", true},
+    {TempPollTimeout, "TWTO", false},
+};
 
 
 
@@ -295,171 +813,97 @@ void PopulateWaveTable(float Ampl, float offset,
  * \retval Null
  */
 int main(void) {
-    uint8_t cnt;
+    bool resumed;
+
+    //  the watchdog stays on after it reset the board, stop it before
+    //  the slow parts of the start up
+    reset_cause = MCUSR;
+    MCUSR = 0;
+    wdt_disable();
 
     //  initialize uart
     cli();
+    resumed = StateRestore();
     UartInit();
+    DacCalInit();
     WaveInit();
+    if (resumed) {
+        //  carry on where the output was
+        StateRestorePhase();
+    }
+#ifdef SYNC_PORT
+    SYNC_DDR |= (1 << SYNC_BIT);
+#endif
+#ifdef TRIGGER_INT
+    TriggerInit();
+#endif
     InterruptInit();
+#ifdef SAMPLE_CLOCK
+    ClockInit();
+#endif
     I2cInit();
+    CommandInit();
+    WatchdogInit();
     sei();  //  enable global interrupts
+    StateSave();
 
+    //  find the temp sensors, the scan runs on the TWI interrupt
+    I2cScan();
+    TaskStart(TASK_TEMP, temp_interval*100U, temp_interval*100U);
+
+    set_sleep_mode(SLEEP_MODE_IDLE);
     while (true) {
-            //  serial reading code
+            uint8_t pending;
 
-            SendReply();
+            WatchdogFeed();
+
+            //  sleep until an interrupt leaves something to do, the sample
+            //  ISR then never competes with main loop polling
+            cli();
+            if (events == 0 && !UartCharWaiting()) {
+                HAL_IDLE();
+                cli();
+            }
+            pending = events;
+            events = 0;
+            sei();
+
+            //  serial reading code
 
-            while (UartCharWaiting() == true) {
+            //  one command at a time, so each one gets its own reply even
+            //  when the host sends the next without waiting
+            while (UartCharWaiting() == true && recieved_byte != '!') {
                 TIMSK0 &= ~(1 << OCIE0A);  // disable the interrupt
-                TIMSK1 &= ~(1 << OCIE1A);  // disable the interrupt
+                tasks_held = true;  //  no temp readings until CONTINUEE!
                 //  if there are chars in receive buffer
                 recieved_byte = UartGetChar();
 
-                if (recieved_byte == '\0') {
-                    //  ignore the null terminator
+                if (recieved_byte == '\0' || recieved_byte == '\r' ||
+                    recieved_byte == '\n') {
+                    //  ignore the null terminator and line ends
                     //  UartPutChar('0');
                     continue;
                 }
 
-                //  send the instruction back
-                //  UartPutChar(recieved_byte);
-                recieved_string[recieved_string_index] = recieved_byte;
-                recieved_string_index++;
-
-                if (recieved_byte == '!') {
-                    //  check for the right format, else send err back
-                    //  get the value from the string and convert it in to int
-                    char value_received[6] = {0};
-                    value_received[0] = recieved_string[4];
-                    value_received[1] = recieved_string[5];
-                    value_received[2] = recieved_string[6];
-                    value_received[3] = recieved_string[7];
-                    value_received[4] = recieved_string[8];
-                    value_received[5] = '\0';
-
-                    //  convert the value to int
-                    char *ptr;
-                    int value_int;
-                    value_int = (int) strtol(value_received, &ptr, 10);
-
-                    //  interpvalue_int the value as a floating point
-                    char *pointer;
-                    float value_float = (double) strtod(value_received,
-                                                                     &pointer);
-
-                    //  change amplitude
-                     if (recieved_string[0] == 'A' &&
-                          recieved_string[1] == 'M' ) {
-                        if (value_float >= 0 && value_float <= 10) {
-                            if (recieved_string[2] == '1') {
-                                //  change amplitude for first wave
-                                waveOne.amplitude = value_float;
-                            } else if (recieved_string[2] == '2') {
-                                //  change amplitude for the second wave
-                                waveTwo.amplitude = value_float;
-                            } else {
-                                //  error
-                                format_error = 1;
-                                continue;
-                            }
-                        } else {
-                            //  error
-                            format_error = 1;
-                            continue;
-                        }
-                        //  send ack
-                        send_ack = 1;
-                        continue;
-                     } else if (recieved_string[0] == 'O' &&
-                                 recieved_string[1] == 'F' ) {
-                        //  put + or - in the string
-                        if (value_float >= -10 && value_float <= 10) {
-                            if (recieved_string[2] == '1') {
-                                //  change offset for first wave
-                                waveOne.offset = value_float;
-                            } else if (recieved_string[2] == '2') {
-                                //  change offset for the second wave
-                                waveTwo.offset = value_float;
-                            } else {
-                                //  error
-                                format_error = 1;
-                                continue;
-                            }
-                        } else {
-                            //  error
-                            format_error = 1;
-                            continue;
-                        }
-                        //  send ack
-                        send_ack = 1;
-                        continue;
-                     } else if (recieved_string[0] == 'F' &&
-                                 recieved_string[1] == 'R' ) {
-                        if (value_int >= 1 && value_int <= 10000) {
-                            if (recieved_string[2] == '1') {
-                                //  change frequency for first wave
-                                waveOne.frequency = value_int;
-                            } else if (recieved_string[2] == '2') {
-                                //  change frequency for the second wave
-                                waveTwo.frequency = value_int;
-                            } else {
-                                //  error
-                                format_error = 1;
-                                continue;
-                            }
-                        } else {
-                                //  error
-                                format_error = 1;
-                                continue;
-                        }
-                        //  send ack
-                        send_ack = 1;
-                        continue;
-                     } else if (recieved_string[0] == 'W' &&
-                                recieved_string[1] == 'A' ) {
-                        if (value_int > 0 && value_int <= 5) {
-                            if (recieved_string[2] == '1') {
-                                //  for the first wave type
-                                waveOne.wave_type = value_int;
-                            } else if (recieved_string[2] == '2') {
-                                //  for the second wave type
-                                waveTwo.wave_type = value_int;
-                            } else {
-                                //  error
-                                format_error = 1;
-                                continue;
-                            }
-                        } else {
-                            format_error = 1;
-                            continue;
-                        }
-                        //  reaches here only if everything is fine - ack
-                        send_ack = 1;
-                        continue;
-                    } else if (recieved_string[0] == 'C' &&
-                    recieved_string[1] == 'O' && recieved_string[2] == 'N' &&
-                    recieved_string[3] == 'T' && recieved_string[4] == 'I' &&
-                    recieved_string[5] == 'N' && recieved_string[6] == 'U' &&
-                    recieved_string[7] == 'E' &&  recieved_string[8] == 'E') {
-                        //  if we can continue the interrupts
-                        send_ack = 1;
-                        continuee = 1;
+                if (ParseByte(recieved_byte)) {
+                    //  run it, any error is sent back by SendReply
+                    if (command.state == PARSE_ERROR) {
+                        format_error = command.error;
                     } else {
-                        //  send error
-                        format_error = 1;
-                        continue;
+                        format_error = RunCommand();
                     }
+                    continue;
                 }
-                _delay_ms(10);
             }
 
-            if (one_second_interrup == 1 && temp_display == 1) {
-                //  get the temperature and display
-                one_second_interrup = 0;
-                GetTemp(ADDR);
-                _delay_ms(10);
+            //  answer the command straight away
+            SendReply();
+
+            if (pending & EVENT_TICK) {
+                //  run the scheduled tasks that are due
+                TaskRunDue();
             }
+            TempPoll();
     }
 }
 
@@ -469,9 +913,13 @@ int main(void) {
  * Adapted from example AVR code (AFS license)
  */
 ISR(UART0_DATA_EMPTY_IRQ) {
-    //  if there is data in the ring buffer, fetch it and send it
-    if (!ring_buffer_is_empty(&ring_buffer_out)) {
-        UDR0 = ring_buffer_get(&ring_buffer_out);
+    //  flow control characters go ahead of the queued data
+    if (flow_char != 0) {
+        UDR0 = flow_char;
+        flow_char = 0;
+    } else if (!ring_buffer_p2_is_empty(&ring_buffer_out)) {
+        //  if there is data in the ring buffer, fetch it and send it
+        UDR0 = ring_buffer_p2_get(&ring_buffer_out);
     } else {
         //  no more data to send, turn off data ready interrupt
         UCSR0B &= ~(1  <<  UDRIE0);
@@ -484,7 +932,24 @@ ISR(UART0_DATA_EMPTY_IRQ) {
  * Adapted from example AVR code (AFS license)
  */
 ISR(UART0_RX_IRQ) {
-    ring_buffer_put(&ring_buffer_in, UDR0);
+    uint8_t data = UDR0;
+
+    if (ring_buffer_is_full(&ring_buffer_in)) {
+        //  no room, drop the byte
+        stats.rx_drops++;
+    } else {
+        ring_buffer_put(&ring_buffer_in, data);
+    }
+
+    //  running low on room, ask the host to pause
+    if (!rx_stopped && UartRxFree() <= RX_STOP_FREE) {
+        rx_stopped = 1;
+        flow_char = XOFF;
+        UCSR0B |= (1  <<  UDRIE0);
+#ifdef UART_RTS_PORT
+        UART_RTS_PORT |= (1 << UART_RTS_BIT);
+#endif
+    }
 }
 
 /**
@@ -514,28 +979,70 @@ static void UartInit(void) {
             (0  <<  UMSEL00);
 
     //  initialize the in and out buffer for the UART
-    ring_buffer_out = ring_buffer_init(out_buffer, BUFFER_SIZE);
-    ring_buffer_in = ring_buffer_init(in_buffer, BUFFER_SIZE);
+    ring_buffer_out = ring_buffer_p2_init(out_buffer, TX_BUFFER_SIZE);
+    ring_buffer_in = ring_buffer_init(in_buffer, RX_BUFFER_SIZE);
+
+#ifdef UART_RTS_PORT
+    //  RTS low, ready to receive
+    UART_RTS_DDR |= (1 << UART_RTS_BIT);
+    UART_RTS_PORT &= ~(1 << UART_RTS_BIT);
+#endif
 }
 
 /**
- * \brief Function for putting a char in the UART buffer
+ * \brief Function for putting a message in the UART buffer
  *
- * \param data the data to add to the UART buffer and send
+ * The whole message is copied under one critical section and the data
+ * ready interrupt is enabled once. Bytes that do not fit are not written.
+ *
+ * \param data the bytes to add to the UART buffer and send
+ * \param len number of bytes
+ * \retval number of bytes queued, less than len if the buffer is full
  *    Adapted from example AVR code (AFS license)
  */
-static inline void UartPutChar(uint8_t data) {
+static uint8_t UartWrite(const void *data, uint8_t len) {
     //  Disable interrupts to get exclusive access to ring_buffer_out.
     cli();
-    if (ring_buffer_is_empty(&ring_buffer_out)) {
-        //  First data in buffer, enable data ready interrupt
+    uint8_t written = ring_buffer_p2_write_bulk(&ring_buffer_out, data, len);
+    if (written != 0) {
+        //  data in buffer, enable data ready interrupt
         UCSR0B |=  (1  <<  UDRIE0);
     }
-    //  Put data in buffer
-    ring_buffer_put(&ring_buffer_out, data);
+
+    //  track the transmit buffer high-water mark
+    uint8_t queued = ring_buffer_p2_count(&ring_buffer_out);
+    if (queued > stats.tx_high) {
+        stats.tx_high = queued;
+    }
 
     //  Re-enable interrupts
     sei();
+    return written;
+}
+
+/**
+ * \brief Function for sending a whole message over UART
+ *
+ * Waits for the UART to drain whenever the buffer fills up.
+ *
+ * \param data the bytes to send
+ * \param len number of bytes
+ */
+static void UartWriteAll(const void *data, uint8_t len) {
+    const uint8_t *next = data;
+
+    while (len > 0) {
+        uint8_t written = UartWrite(next, len);
+        next += written;
+        len -= written;
+        if (written > 0) {
+            //  long replies take a while at 9600 baud
+            WatchdogFeed();
+        }
+        if (len > 0) {
+            HAL_IDLE();
+        }
+    }
 }
 
 /**
@@ -544,7 +1051,20 @@ static inline void UartPutChar(uint8_t data) {
  * \retval Next data byte in receive buffer
  */
 static inline uint8_t UartGetChar(void) {
-    return ring_buffer_get(&ring_buffer_in);
+    uint8_t data = ring_buffer_get(&ring_buffer_in);
+
+    //  enough room again, let the host resume
+    if (rx_stopped && UartRxFree() >= RX_RESUME_FREE) {
+        cli();
+        rx_stopped = 0;
+        flow_char = XON;
+        UCSR0B |= (1  <<  UDRIE0);
+#ifdef UART_RTS_PORT
+        UART_RTS_PORT &= ~(1 << UART_RTS_BIT);
+#endif
+        sei();
+    }
+    return data;
 }
 
 
@@ -558,16 +1078,131 @@ static inline bool UartCharWaiting(void) {
     return !ring_buffer_is_empty(&ring_buffer_in);
 }
 
+/**
+ * \brief Function to get the free room in the UART receive buffer
+ * \retval bytes that can still be received
+ */
+static inline uint8_t UartRxFree(void) {
+    //  the RX ISR moves write_offset, read each offset once
+    uint8_t write = ring_buffer_in.write_offset;
+    uint8_t read = ring_buffer_in.read_offset;
+    uint8_t used = write - read;
+
+    if (write < read) {
+        used += ring_buffer_in.size;
+    }
+    return ring_buffer_in.size - 1 - used;
+}
+
+/**
+ * \brief Sends the "#<seq> " prefix of a tagged reply
+ *
+ * Nothing is sent for an untagged command, so replies stay as they were
+ * for hosts that send one command at a time.
+ */
+static void ReplyTag(void) {
+    if (reply_tag_len > 0) {
+        UartWriteAll(reply_tag, reply_tag_len);
+        UartWriteAll(" ", 1);
+    }
+}
+
+/**
+ * \brief Function for adding text to a reply
+ * \param reply the reply being built
+ * \param len current length of the reply
+ * \param text the text to add
+ * \retval new length of the reply
+ */
+static uint8_t ReplyText(char *reply, uint8_t len, const char *text) {
+    while (*text != 0) {
+        reply[len++] = *text++;
+    }
+    return len;
+}
+
+/**
+ * \brief Function for adding a signed decimal number to a reply
+ * \param reply the reply being built
+ * \param len current length of the reply
+ * \param value the number to add
+ * \retval new length of the reply
+ */
+static uint8_t ReplyNumber(char *reply, uint8_t len, long value) {
+    char digits[11];
+    uint8_t count = 0;
+
+    if (value < 0) {
+        reply[len++] = '-';
+        value = -value;
+    }
+    do {
+        digits[count++] = (value % 10) + '0';
+        value /= 10;
+    } while (value != 0);
+    while (count > 0) {
+        reply[len++] = digits[--count];
+    }
+    return len;
+}
+
+/**
+ * \brief Function for adding a field to a binary frame, low byte first
+ * \param frame the frame being built
+ * \param len current length of the frame
+ * \param value the field
+ * \param bytes size of the field on the wire
+ * \retval new length of the frame
+ */
+static uint8_t FrameLittleEndian(uint8_t *frame, uint8_t len, uint32_t value,
+                                 uint8_t bytes) {
+    while (bytes-- > 0) {
+        frame[len++] = value;
+        value >>= 8;
+    }
+    return len;
+}
+
+/**
+ * \brief Function for sending binary data as hex, two upper case digits
+ *        a byte
+ *
+ * Keeps binary replies printable, so they never hold a line end or a
+ * byte the host takes for XON/XOFF.
+ * \param data the bytes to send
+ * \param len number of bytes
+ */
+static void UartWriteHex(const uint8_t *data, uint8_t len) {
+    char hex[32];
+
+    while (len > 0) {
+        uint8_t count = 0;
+        while (len > 0 && count < sizeof(hex)) {
+            hex[count++] = "0123456789ABCDEF"[*data >> 4];
+            hex[count++] = "0123456789ABCDEF"[*data & 15];
+            data++;
+            len--;
+        }
+        UartWriteAll(hex, count);
+    }
+}
+
 
 
 /**
  * \brief Function populating the respective lookup tables
- * \param amplitude of wave, the offset, frequency, wavetype and waveno
+ *
+ * With dither set a table driven wave is rendered as 128 8.8 levels, one
+ * for every other index, which the sample interrupt plays with first
+ * order error feedback. Small amplitudes then average to levels between
+ * the 8 bit codes; the step shape is 128 points instead of 256.
+ * \param amplitude of wave, the offset, frequency, wavetype, waveno and
+ *        dither
  * \retval Null
  */
 void PopulateWaveTable(float Ampl, float offset,
-                      int frequency, int waveType, int WaveNo) {
-    uint8_t *pointer;  //  base wave pointer
+                      int frequency, int waveType, int WaveNo, int dither) {
+    const uint8_t *pointer = NULL;  //  base wave, NULL for noise and pulse
     //  set the pointer to the base wave
     switch (waveType) {
         case SINEWAVE:
@@ -587,372 +1222,2122 @@ void PopulateWaveTable(float Ampl, float offset,
             break;
     }
 
+    uint32_t start = TickMicros();
+
+    //  one exact period when the sample rate allows it, else the whole table
+    uint16_t period = (pointer == NULL) ? 0 :
+                      ExactPeriod(SampleRate(), frequency);
+    uint16_t length = (period != 0) ? period : 256;
+
     //  reset the indexes
     wave_one_index = 0;
     wave_two_index = 0;
 
     if (WaveNo == 1) {  //  if wave 1
-        int value;  //  value to place in current buffer
-        float trueRepeatCount = 0;  //  number of times to repeat
-        float trueSkipCount = 0;  //  number of times to skip
-
-        //  frequency adjustment code for wave 1
-        //  for repeat mode
-        repeat_count_1 = threshold_freq_int/frequency;  //  integer division
-        trueRepeatCount = threshold_freq_float/frequency;  //  float division
-        threshold_rep_1 = scale*(1-(trueRepeatCount-repeat_count_1));
-        //  for skip mode
-        inverse_repeat_1 = frequency/threshold_freq_int;
-        trueSkipCount = frequency/threshold_freq_float;
-        threshold_skip_1 = scale*(1-(trueSkipCount - inverse_repeat_1));
-
-        //  populate the current wave
-        for (int i = 0; i < 256; i++) {
+        float value;  //  value to place in current buffer
+
+        //  noise and pulse waves index the buffer with their sample
+        noise_type_1 = (pointer == NULL && waveType != PULSEWAVE) ?
+                        waveType : 0;
+        pulse_1 = (waveType == PULSEWAVE);
+        pulse_phase_1 = 0;
+        period_last_1 = (period != 0) ? period - 1 : 0;
+        memset(noise_1.rows, 0, sizeof(noise_1.rows));
+        noise_1.sum = 0;
+        dither_1 = (dither != 0 && pointer != NULL);
+        dither_error_1 = 0;
+
+        //  populate the current wave, noise and pulse use it as a scale
+        for (int i = 0; i < length; i += 1 + dither_1) {
+            uint8_t base = (pointer == NULL) ? i :
+                           TableSample(pointer, i, length);
             //  offset and amplitude to output value
-            value = (Ampl/3)*pointer[i] +(127*(3-Ampl)/3)- ((offset/3)*127);
+            value = (Ampl/3)*base +(127*(3-Ampl)/3)- ((offset/3)*127);
 
-            //  write to the current wave buffer
-            if (value > 255) {
-                current_wave[i] = 255;
-            } else if (value < 0) {
-                current_wave[i] =  0;
+            //  write to the current wave buffer, calibrated
+            if (dither_1) {
+                current_wave.levels[i >> 1] = DacLevel(0, value);
             } else {
-                current_wave[i] = value;
+                current_wave.codes[i] = DacCode(0, value);
             }
         }
-    } else if (WaveNo = 2) {
+    } else if (WaveNo == 2) {
         //  code for wave 2
-
-        //  frequency adjustment code for wave
-        float trueRepeatCount_2 = 0;  //  number of times to repeat
-        float trueSkipCount_2 = 0;  //  number of times to skip
-
-        //  times to repeat in repeat mode
-        repeat_count_2 = threshold_freq_int/frequency;
-        trueRepeatCount_2 = threshold_freq_float/frequency;
-        threshold_rep_2 = scale*(1-(trueRepeatCount_2 - repeat_count_2));
-
-        //  times to skip in skip mode
-        inverse_repeat_2 = frequency/threshold_freq_int;
-        trueSkipCount_2 = frequency/threshold_freq_float;
-        threshold_skip_2 = scale*(1-(trueSkipCount_2 - inverse_repeat_2));
-        int value;
+        float value;
+
+        noise_type_2 = (pointer == NULL && waveType != PULSEWAVE) ?
+                        waveType : 0;
+        pulse_2 = (waveType == PULSEWAVE);
+        pulse_phase_2 = 0;
+        period_last_2 = (period != 0) ? period - 1 : 0;
+        memset(noise_2.rows, 0, sizeof(noise_2.rows));
+        noise_2.sum = 0;
+        dither_2 = (dither != 0 && pointer != NULL);
+        dither_error_2 = 0;
 
         //  change the amplitude and the offset
-        for (int i = 0; i < 256; i++) {
+        for (int i = 0; i < length; i += 1 + dither_2) {
+            uint8_t base = (pointer == NULL) ? i :
+                           TableSample(pointer, i, length);
             //  offset and amplitude to output value
-            value = (Ampl/3)*pointer[i] +(127*(3-Ampl)/3)- ((offset/3)*127);
+            value = (Ampl/3)*base +(127*(3-Ampl)/3)- ((offset/3)*127);
 
-            //  write to the current wave buffer
-            if (value > 255) {
-                current_2_wave[i] = 255;
-            } else if (value < 0) {
-                current_2_wave[i] =  0;
+            //  write to the current wave buffer, calibrated
+            if (dither_2) {
+                current_2_wave.levels[i >> 1] = DacLevel(1, value);
             } else {
-                current_2_wave[i] = value;
+                current_2_wave.codes[i] = DacCode(1, value);
             }
         }
     }
-}
-
 
+    //  track the longest render
+    uint32_t took = TickMicros() - start;
+    if (took > stats.render_us) {
+        stats.render_us = took;
+    }
+}
 
 
 /**
- * \brief One second interrupt - signal to read & transmit temp
+ * \brief Loads the DAC calibration from EEPROM
  *
- * \param None
- *
- */
-ISR(TIMER1_COMPA_vect) {
-    one_second_interrup = 1;
-}
-
-/**
- * \brief Send the I2C Start Bit
+ * Erased or out of range settings leave the channel uncorrected.
  * \param Null
- * \retval Return 1 on failure, 3 on time out, 0 on success
+ * \retval Null
  */
-int StartSend(void) {
-    //  send start bit
-    TWCR = (1  <<  TWINT) | (1  <<  TWSTA) | (1  <<  TWEN);
-
-    int counter = 0;
-    //  wait for iterupt flag to be set
-    while (!(TWCR & (1  <<  TWINT))) {
-        counter++;
-        if (counter > 10000) {
-            //  took too long - return 3
-            return 3;
+void DacCalInit(void) {
+    for (uint8_t channel = 0; channel < 2; channel++) {
+        DacCal *cal = &dac_cal[channel];
+
+        eeprom_read_block(cal, &dac_cal_ee[channel], sizeof(DacCal));
+        if (cal->mode > DAC_CAL_TABLE || cal->gain < DAC_GAIN_MIN ||
+            cal->gain > DAC_GAIN_MAX || cal->offset < -DAC_OFFSET_MAX ||
+            cal->offset > DAC_OFFSET_MAX) {
+            cal->mode = DAC_CAL_OFF;
+            cal->gain = 1000;
+            cal->offset = 0;
         }
+        DacCalUpdate(channel);
     }
-
-    //  Check that start was sent successfully
-    if ((TWSR & 0xF8) != TW_START && (TWSR & 0xF8) != TW_REP_START) {
-        //  printf("Error Start Condition\n");
-        return 1;
-    }
-
-    return 0;
 }
 
 /**
- * \brief Stops I2C
- * \param Null
+ * \brief Works out the render correction for a channel's gain and offset
+ *
+ * The ladder puts out gain*code + offset, so writing
+ * (code - offset)/gain gives the code that was asked for.
+ * \param channel 0 for wave 1, 1 for wave 2
  * \retval Null
  */
-void StopSend(void) {
-    TWCR = (1  <<  TWINT) | (1  <<  TWEN) | (1  <<  TWSTO);
+void DacCalUpdate(uint8_t channel) {
+    dac_scale[channel] = 1000.0/dac_cal[channel].gain;
+    dac_shift[channel] = -dac_cal[channel].offset/(float) dac_cal[channel].gain;
 }
 
 /**
- * \brief Sends control byte
- * \param Read -1 read mode, 0 write mode, address to read
- * \retval Return 1 on failure, 3 on time out, 0 on success
+ * \brief Output code for a rendered value, with the calibration applied
+ *
+ * Runs while the tables are built, so correcting costs the sample
+ * interrupt nothing.
+ * \param channel 0 for wave 1, 1 for wave 2
+ * \param value ideal output, 0 to 255
+ * \retval port value for the buffer
  */
-int ControlSend(int read, unsigned char addr) {
-    addr = (addr  <<  1);
-
-    int controlByte = addr + read;
+static uint8_t DacCode(uint8_t channel, float value) {
+    uint8_t mode = dac_cal[channel].mode;
+    int code;
 
-    //  send
-    TWDR = controlByte;
-    TWCR = (1  <<  TWINT) | (1  <<  TWEN);
-
-    int counter = 0;
-    //  Wait for ACK or NACK response
-    while (!(TWCR & (1  <<  TWINT))) {
-        counter++;
-        if (counter > 10000) {
-            //  took too long - time out
-            return 3;
-        }
+    if (mode == DAC_CAL_GAIN) {
+        value = value*dac_scale[channel] + dac_shift[channel];
     }
-    //  if not ACK then error
-    if ((TWSR & 0xF8) != TW_MT_SLA_ACK && (TWSR & 0xF8) != TW_MR_SLA_ACK) {
-        return 1;
+    code = value;
+    if (code > 255) {
+        code = 255;
+    } else if (code < 0) {
+        code = 0;
     }
-
-    return 0;
+    if (mode == DAC_CAL_TABLE) {
+        code = eeprom_read_byte(&dac_table_ee[channel][code]);
+    }
+    return code;
 }
 
 /**
- * \brief Sends data via I2C
- * \param Data to send
- * \retval Return 1 on failure, 3 on time out, 0 on success
+ * \brief 8.8 fixed point output level for a dithered table
+ *
+ * As DacCode, but keeps 8 fraction bits for the sample interrupt to
+ * carry from sample to sample. A correction table is interpolated
+ * between its entries.
+ * \param channel 0 for wave 1, 1 for wave 2
+ * \param value ideal output, 0 to 255
+ * \retval level, 0 to 0xFF00 so adding the carried error can not overflow
  */
-int DataSend(int data) {
-    //  send through data
-    TWDR = data;
-    TWCR = (1  <<  TWINT) | (1  <<  TWEN);
+static uint16_t DacLevel(uint8_t channel, float value) {
+    uint8_t mode = dac_cal[channel].mode;
+    uint16_t level;
 
-    int counter;
-    //  Wait for ACK or NACK
-    while (!(TWCR & (1  <<  TWINT))) {
-        counter++;
-        if (counter > 10000) {
-            return 3;
-        }
+    if (mode == DAC_CAL_GAIN) {
+        value = value*dac_scale[channel] + dac_shift[channel];
     }
-
-    //  if not ACK then error
-    if ((TWSR & 0xF8) != TW_MT_DATA_ACK) {
-        return 1;
+    if (value >= 255) {
+        level = 0xFF00;
+    } else if (value <= 0) {
+        level = 0;
+    } else {
+        level = value*256;
     }
-
-    return 0;
+    if (mode == DAC_CAL_TABLE && level < 0xFF00) {
+        uint8_t code = level >> 8;
+        uint8_t a = eeprom_read_byte(&dac_table_ee[channel][code]);
+        uint8_t b = eeprom_read_byte(&dac_table_ee[channel][code + 1]);
+        level = ((uint16_t) a << 8) + ((int) b - a)*(long) (level & 0xFF);
+    } else if (mode == DAC_CAL_TABLE) {
+        level = (uint16_t) eeprom_read_byte(&dac_table_ee[channel][255]) << 8;
+    }
+    return level;
 }
 
-
 /**
- * \brief Get the temperature sensor data.
- * \param last is 1 if want the last byte, sends NACK
- * \retval Data read, 0 on timeout
+ * \brief Checksum of a channel's correction table, as CK! sends it
+ * \param channel 0 for wave 1, 1 for wave 2
+ * \retval Fletcher-16 of the 256 entries
  */
-unsigned char DataGet(unsigned char last) {
-    register unsigned char data = 0;
-
-    if (last) {
-        //  send NACK after receiving data
-        TWCR &= (~(1  <<  TWEA));
-        } else {
-        TWCR |= (1  <<  TWEA);
-    }
-
-    TWCR |= (1  <<  TWINT);
-
-    int counter = 0;
-    //  Wait for data to be received
-    while (!(TWCR & (1  <<  TWINT))) {
-        counter++;
-        if (counter > 10000) {
-            return 0;
-        }
+uint16_t DacTableCheck(uint8_t channel) {
+    uint8_t sum = 0;
+    uint8_t check = 0;
+
+    for (uint16_t i = 0; i < 256; i++) {
+        uint16_t next = sum + eeprom_read_byte(&dac_table_ee[channel][i]);
+        sum = next % 255;
+        next = check + sum;
+        check = next % 255;
     }
+    return ((uint16_t) check << 8) | sum;
+}
 
-    if ((TWSR & 0xF8) == TW_MR_DATA_ACK || (TWSR & 0xF8) == TW_MR_DATA_NACK) {
-        data = TWDR;
-    }
 
-    return data;
+/**
+ * \brief Read a base table at position i of length evenly spaced samples
+ *
+ * Interpolates linearly between table entries, so a period-exact buffer
+ * of any length follows the base shape.
+ * \param base table in flash, sample number, samples per period
+ * \retval table value
+ */
+static uint8_t TableSample(const uint8_t *table, uint16_t i,
+                           uint16_t length) {
+    uint16_t position = ((uint32_t) i << 16)/length;  //  8.8 table index
+    uint8_t index = position >> 8;
+    uint8_t a = pgm_read_byte(&table[index]);
+    uint8_t b = pgm_read_byte(&table[(uint8_t) (index + 1)]);
+
+    return a + (((int) b - a)*(position & 0xFF) >> 8);
 }
 
 
-
 /**
- * \brief Read the temperature from the temp sensor
- * \param Address to communicate to
- * \retval Null
+ * \brief Current sample rate from the Timer0 settings
+ *
+ * A slave's Timer0 counts the master's clock on T0, so its rate is the
+ * CLKT! rate the rig planned for, not one from the prescaler.
+ * \param Null
+ * \retval samples per second
  */
-void GetTemp(unsigned char addr) {
-    int temp = 0;
-    if (StartSend() != 3) {
-            ControlSend(WRITE, addr);
-            DataSend(0x51);
-            StopSend();
-            StartSend();
-            ControlSend(WRITE, addr);
-            DataSend(0xAA);
-            StartSend();
-            ControlSend(READ, addr);
-            temperature_msb = DataGet(0);  //  msb of temperature
-            int sigValue = temperature_msb/10;
-            UartPutChar(sigValue+'0');
-            UartPutChar((temperature_msb-(sigValue*10))+'0');
-            UartPutChar('\n');
+float SampleRate(void) {
+#ifdef SAMPLE_CLOCK
+    if ((sample_clock_select & ((1 << CS02) | (1 << CS01))) ==
+        ((1 << CS02) | (1 << CS01))) {
+        return (float) F_CPU/(8L*clock_top);
     }
+#endif
+    return (float) F_CPU/((long) sample_prescaler*(OCR0A + 1));
 }
 
+
 /**
- * \brief Initializes the TWI clock
- * \param Null
- * \retval Null
+ * \brief Samples per period if one period fits the buffer exactly
+ *
+ * A wave whose period is within EXACT_TOLERANCE_PPM of a whole number of
+ * samples (2 to 256) can be rendered as one period and looped, with no
+ * repeat/skip dithering at all.
+ * \param sample rate, frequency
+ * \retval samples per period, 0 if no exact period fits
  */
-void I2cInit(void) {
-    TWSR = 0;
-    TWBR = ((F_CPU / SCL_CLOCK) - 16) / 2;
+uint16_t ExactPeriod(float rate, int frequency) {
+    float samples = rate/frequency;
+    uint16_t period;
+
+    if (samples < 1.5 || samples > 256.5) {
+        return 0;
+    }
+    period = samples + 0.5;
+    if (fabs(samples - period) > samples*(EXACT_TOLERANCE_PPM/1e6)) {
+        return 0;
+    }
+    return period;
 }
 
 
 /**
- * \brief Initializes the timer interrupts
- * \param Null
- * \retval Null
+ * \brief Work out the repeat/skip step values for one wave
+ *
+ * Each table index is held for repeat_count or repeat_count+1 samples (or
+ * the index advances by inverse_repeat or inverse_repeat+1 per sample), the
+ * longer step being used for the last samples of every scale-long cycle.
+ * Waves with an exact period (see ExactPeriod) skip the dithering, pulse
+ * waves use a 32 bit phase accumulator instead and noise waves have no
+ * frequency to match.
+ * \param sample rate, wave to plan, steps to fill in
+ * \retval relative frequency error of the produced wave
  */
-void InterruptInit(void) {
-    //  sets the pre-scaler as 1
-    TCCR1B |=  (1 << WGM12)|(1 << CS12)|(0 << CS11) |(1 << CS10);
-    //  interrupt settings
-    TCNT1 = 0;  //  init the counter
-    OCR1A = 15000;  //  initialize compare register
-    TIMSK1 |= (1  <<  OCIE1A);  //  enable the output compare interrupt
+float PlanWaveSteps(float rate, const Wave *wave, WaveSteps *steps) {
+    int frequency = wave->frequency;
+    float ideal = rate/(256.0*frequency);  //  samples per table index
+    float actual;  //  frequency the steps produce
+    int whole;
+    int extra;  //  long steps out of every scale steps
+
+    steps->phase_step = 0;
+    steps->period = 0;
+    if (wave->wave_type == NOISEWAVE || wave->wave_type == PINKWAVE) {
+        steps->repeat_count = 0;
+        steps->threshold_rep = 0;
+        steps->inverse_repeat = 0;
+        steps->threshold_skip = 0;
+        steps->mode = 'N';
+        return 0;
+    } else if (wave->wave_type == PULSEWAVE) {
+        float step = frequency*4294967296.0/rate;  //  phase per sample
+        steps->repeat_count = 0;
+        steps->threshold_rep = 0;
+        steps->inverse_repeat = 0;
+        steps->threshold_skip = 0;
+        steps->phase_step = step + 0.5;
+        steps->mode = 'P';
+        return (steps->phase_step - step)/step;
+    }
+
+    //  dithered steps, still needed if the buffer is period-exact
+    steps->mode = 'D';
+    if (ideal >= 1) {
+        //  repeat mode
+        whole = ideal;
+        extra = (ideal - whole)*scale + 0.5;
+        if (extra == scale) {
+            whole++;
+            extra = 0;
+        }
+        steps->repeat_count = whole;
+        steps->threshold_rep = scale - 1 - extra;
+        steps->inverse_repeat = 0;
+        steps->threshold_skip = 0;
+        actual = rate/(256.0*(whole + (float) extra/scale));
+    } else {
+        //  skip mode
+        ideal = 1/ideal;  //  table indexes per sample
+        whole = ideal;
+        extra = (ideal - whole)*scale + 0.5;
+        if (extra == scale) {
+            whole++;
+            extra = 0;
+        }
+        steps->repeat_count = 0;
+        steps->threshold_rep = 0;
+        steps->inverse_repeat = whole;
+        steps->threshold_skip = scale - 1 - extra;
+        actual = rate*(whole + (float) extra/scale)/256.0;
+    }
 
+    steps->period = ExactPeriod(rate, frequency);
+    if (steps->period != 0) {
+        steps->mode = 'X';
+        actual = rate/steps->period;
+    }
 
-    //  interrupt setting for the sampling frequency
-    TCCR0B |= (0  <<  CS02)|(1 << CS01) |(0 << CS00);  //  8 prescaller
-    TCCR0A |= (1 << WGM01);
-    TCNT0 = 0;
-    OCR0A = 44;
-    TIMSK0 |= (1 << OCIE0A);  //  enable the interrup
+    return (actual - frequency)/frequency;
 }
 
 
 /**
- * \brief Initialize the waves
+ * \brief Pick the Timer0 prescaler and OCR0A for the current waves
+ *
+ * Tries every sample rate the ISR budget allows down to PLAN_MIN_RATE and
+ * keeps the fastest that gets both waves within PLAN_TOLERANCE_PPM of
+ * their frequency, or the one with the smallest error if none is within
+ * tolerance. A slower rate with more period-exact waves only wins if the
+ * faster one's error adds up to more than one of its samples every
+ * period, as exactness is not worth a coarser step otherwise. The
+ * budget is the larger of SAMPLE_ISR_BUDGET and SAMPLE_ISR_HEADROOM times
+ * the longest sample ISR measured so far.
  * \param Null
  * \retval Null
  */
-void WaveInit(void) {
-    //  set the threshold frequency
-    threshold_freq_int = 174;
-    threshold_freq_float = 174.5;
-    //  set the output ports for wave 1;
-    DDRD |= (1 << DDD2| 1 << DDD3 | 1 << DDD4 | 1 << DDD5
-    | 1 << DDD6 | 1 << DDD7);
-    DDRC |= (1  <<  DDC0 | 1  <<  DDC1 | 1 <<  DDC2 | 1 <<  DDC3);
+void PlanSampleRate(void) {
+    WaveSteps steps_1, steps_2;  //  steps of the candidate rate
+    WaveSteps best_1, best_2;  //  steps of the best rate so far
+    float best_error = FLT_MAX;
+    float best_rate = 0;
+    bool best_within = false;  //  best rate is within tolerance
+    uint8_t best_exact = 0;  //  period-exact waves at the best rate
+    float best_drift = 0;  //  samples the best rate is off by every period
+    uint8_t best_select = sample_clock_select;
+    uint16_t best_prescaler = sample_prescaler;
+    uint16_t best_top = 0;
+    long budget;  //  minimum cycles per sample
+
+    //  fold the ISR length measured at the current prescaler into the budget
+    sample_isr_cycles = SampleIsrCycles();
+    budget = (long) sample_isr_cycles*SAMPLE_ISR_HEADROOM;
+    if (budget < SAMPLE_ISR_BUDGET) {
+        budget = SAMPLE_ISR_BUDGET;
+    }
 
-    DDRB |= (1 << DDB0 |1  <<  DDB1 | 1 << DDB2 | 1 << DDB3
-    | 1 << DDB4 | 1 << DDB5);
+#ifdef SAMPLE_CLOCK
+    if (clock_mode != CLOCK_FREE) {
+        //  every board of a rig plans for the CLKT! rate, a slave's Timer0
+        //  then matches on every edge of the master's clock
+        best_rate = (float) F_CPU/(8L*clock_top);
+        wave_error_1 = PlanWaveSteps(best_rate, &waveOne, &best_1)*1e6;
+        wave_error_2 = PlanWaveSteps(best_rate, &waveTwo, &best_2)*1e6;
+        wave_mode_1 = best_1.mode;
+        wave_mode_2 = best_2.mode;
+        best_prescaler = 8;
+        if (clock_mode == CLOCK_MASTER) {
+            best_select = (1 << CS01);
+            best_top = clock_top;
+        } else {
+            //  T0 rising edges
+            best_select = (1 << CS02) | (1 << CS01) | (1 << CS00);
+            best_top = 1;
+        }
+    } else
+#endif
+    for (uint8_t p = 0; p < sizeof(timer0_prescalers)/sizeof(uint16_t); p++) {
+        uint16_t prescaler = timer0_prescalers[p];
+        uint16_t top = (budget + prescaler - 1)/prescaler;  //  OCR0A + 1
+
+        for (; top <= 256; top++) {
+            float rate = (float) F_CPU/((long) prescaler*top);
+            float error_1, error_2, error, drift;
+            bool within, better;
+            uint8_t exact;
+
+            if (rate < PLAN_MIN_RATE) {
+                break;
+            }
+            error_1 = PlanWaveSteps(rate, &waveOne, &steps_1);
+            error_2 = PlanWaveSteps(rate, &waveTwo, &steps_2);
+            error = fabs(error_1) > fabs(error_2) ?
+                    fabs(error_1) : fabs(error_2);
+
+            within = error <= PLAN_TOLERANCE_PPM/1e6;
+            exact = (steps_1.period != 0) + (steps_2.period != 0);
+            drift = fabs(error_1)*rate/waveOne.frequency;
+            if (fabs(error_2)*rate/waveTwo.frequency > drift) {
+                drift = fabs(error_2)*rate/waveTwo.frequency;
+            }
 
+            //  within tolerance prefer speed, and jitter-free waves only
+            //  over a rate that drifts by a whole sample every period
+            if (within && best_within) {
+                if (rate > best_rate) {
+                    better = exact >= best_exact || drift <= 1;
+                } else {
+                    better = exact > best_exact && best_drift > 1;
+                }
+            } else {
+                better = within || (!best_within && error < best_error);
+            }
+            if (better) {
+                best_within = within;
+                best_exact = exact;
+                best_error = error;
+                best_drift = drift;
+                best_rate = rate;
+                best_select = timer0_clock_selects[p];
+                best_prescaler = prescaler;
+                best_top = top;
+                best_1 = steps_1;
+                best_2 = steps_2;
+                wave_error_1 = error_1*1e6;
+                wave_error_2 = error_2*1e6;
+                wave_mode_1 = steps_1.mode;
+                wave_mode_2 = steps_2.mode;
+            }
+        }
+    }
 
+    if (best_top == 0) {
+        //  nothing fits the budget, keep the current rate
+        return;
+    }
 
-    //  populate wave 1 lookup table
-    PopulateWaveTable(waveOne.amplitude, waveOne.offset, waveOne.frequency,
-    waveOne.wave_type, 1);
+    //  switch Timer0 to the chosen rate
+    sampling_frequency = best_rate + 0.5;
+    sample_clock_select = best_select;
+    sample_prescaler = best_prescaler;
+    sample_isr_ticks = 0;
+    TCCR0B = (TCCR0B & ~((1 << CS02) | (1 << CS01) | (1 << CS00))) |
+              sample_clock_select;
+    OCR0A = best_top - 1;
+#ifdef SAMPLE_CLOCK
+    OCR0B = best_top/2;  //  a master's clock is high for half the sample
+#endif
+    TCNT0 = 0;
 
-    //  populate wave 2 lookup table
-    PopulateWaveTable(waveTwo.amplitude, waveTwo.offset, waveTwo.frequency,
-    waveTwo.wave_type, 2);
+    //  load the step values for both waves
+    repeat_count_1 = best_1.repeat_count;
+    threshold_rep_1 = best_1.threshold_rep;
+    inverse_repeat_1 = best_1.inverse_repeat;
+    threshold_skip_1 = best_1.threshold_skip;
+    current_count_1 = 0;
+    sample_count_1 = 0;
+    pulse_step_1 = best_1.phase_step;
+    pulse_sweep_1 = PulseSweepStep(waveOne.sweep);
+
+    repeat_count_2 = best_2.repeat_count;
+    threshold_rep_2 = best_2.threshold_rep;
+    inverse_repeat_2 = best_2.inverse_repeat;
+    threshold_skip_2 = best_2.threshold_skip;
+    current_count_2 = 0;
+    sample_count_2 = 0;
+    pulse_step_2 = best_2.phase_step;
+    pulse_sweep_2 = PulseSweepStep(waveTwo.sweep);
 }
 
+
 /**
- * \brief Clears the recieve buffer
+ * \brief Longest sample ISR measured so far
  * \param Null
- * \retval Null
+ * \retval cycles from the compare match to the ISR exit
  */
-void ClearReceiveBuffer(void) {
-        for (int cnt = 0; cnt < strlen(recieved_string); cnt++) {
-            //  clear receive buffer
-            recieved_string[cnt] = 0;
-        }
-        recieved_string_index = 0;
+uint16_t SampleIsrCycles(void) {
+    uint16_t cycles = (uint16_t) sample_isr_ticks*sample_prescaler;
+
+    return (cycles > sample_isr_cycles) ? cycles : sample_isr_cycles;
 }
 
 
 /**
- * \brief Sends ack or err
- * \param Null
- * \retval Null
+ * \brief Convert a pulse duty sweep to a per sample duty increment
+ * \param sweep in 0.1 % per second
+ * \retval increment of the 32 bit duty compare per sample
  */
-void SendReply(void) {
-    if (format_error == 1) {  //  send err and clear buffer
-        format_error = 0;
-        for (int cnt = 0; cnt < strlen(err); cnt++) {  //  send "ERR\n" back
-            UartPutChar(err[cnt]);
-        }
-        ClearReceiveBuffer();
-    }
-
-    if (send_ack == 1) {
-        //  send ack and clear buffer, update lookup tables
-
-        //  for high frequency waves, increase the sampling rate
-        if (waveOne.frequency >= 6000 || waveTwo.frequency >= 6000) {
-            OCR0A = 39;
-            threshold_freq_int = 196;
-            threshold_freq_float = 196.0;
-            temp_display = 0;
-            } else {
-            OCR0A = 44;
-            threshold_freq_int = 174;
-            threshold_freq_float = 174.5;
-            temp_display = 1;
-        }
+int32_t PulseSweepStep(int sweep) {
+    return sweep*4294967.296/sampling_frequency;
+}
 
 
-        // populate the new waves
-        PopulateWaveTable(waveOne.amplitude, waveOne.offset,
-        waveOne.frequency, waveOne.wave_type, 1);
 
-        PopulateWaveTable(waveTwo.amplitude, waveTwo.offset,
-        waveTwo.frequency, waveTwo.wave_type, 2);
+
+/**
+ * \brief 1 ms tick - drives the task scheduler
+ *
+ * Kept short, the tasks run from the main loop on EVENT_TICK.
+ *
+ * \param None
+ *
+ */
+ISR(TIMER1_COMPA_vect) {
+    tick_ms++;
+    events |= EVENT_TICK;
+}
+
+/**
+ * \brief Milliseconds since reset
+ * \param Null
+ * \retval tick_ms, read atomically
+ */
+uint32_t TickMs(void) {
+    uint32_t ms;
+
+    cli();
+    ms = tick_ms;
+    sei();
+    return ms;
+}
+
+/**
+ * \brief Microseconds since reset, to 4 us
+ *
+ * Adds the Timer1 count to tick_ms, counting a tick whose ISR is still
+ * pending.
+ * \param Null
+ * \retval time in microseconds, wraps after 71 minutes
+ */
+uint32_t TickMicros(void) {
+    uint32_t ms;
+    uint16_t count;
+
+    cli();
+    ms = tick_ms;
+    count = TCNT1;
+    if ((TIFR1 & (1 << OCF1A)) && count < TICK_OCR) {
+        ms++;
+    }
+    sei();
+    return ms*1000 + count*4;
+}
+
+/**
+ * \brief Schedules a task
+ * \param task TASK_ index
+ * \param delay ms until the first run
+ * \param period ms between runs, 0 to run once
+ * \retval Null
+ */
+void TaskStart(uint8_t task, uint16_t delay, uint16_t period) {
+    tasks[task].due = TickMs() + delay;
+    tasks[task].period = period;
+    tasks[task].active = true;
+}
+
+/**
+ * \brief Cancels a task
+ * \param task TASK_ index
+ * \retval Null
+ */
+void TaskStop(uint8_t task) {
+    tasks[task].active = false;
+}
+
+/**
+ * \brief Runs the tasks that are due, called on every tick
+ *
+ * A task is rescheduled before it runs, so it may stop or restart
+ * itself. One that fell behind, being held or after a slow run, runs
+ * once and keeps its period from now rather than catching up.
+ * \param Null
+ * \retval Null
+ */
+void TaskRunDue(void) {
+    uint32_t now = TickMs();
+
+    for (uint8_t i = 0; i < TASKS; i++) {
+        Task *task = &tasks[i];
+        if (!task->active || (task->hold && tasks_held) ||
+            (int32_t) (now - task->due) < 0) {
+            continue;
+        }
+
+        if (task->period == 0) {
+            task->active = false;
+        } else {
+            task->due += task->period;
+            if ((int32_t) (now - task->due) >= 0) {
+                task->due = now + task->period;
+            }
+        }
+
+        uint32_t start = TickMicros();
+        task->run();
+        uint32_t took = TickMicros() - start;
+        task->runs++;
+        task->total_us += took;
+        if (took > task->max_us) {
+            task->max_us = took;
+        }
+    }
+}
+
+/**
+ * \brief TWI interrupt - runs one TwiJob a bus event at a time
+ *
+ * Sends SLA+W and the write bytes, then a repeated start, SLA+R and the
+ * read bytes (NACKing the last), then STOP. A job without read bytes
+ * stops after the writes; a job without either just probes the address.
+ *
+ * \param None
+ *
+ */
+ISR(TWI_vect) {
+    switch (TWSR & 0xF8) {
+    case TW_START:
+    case TW_REP_START:
+        //  writes first, reads after the repeated start
+        if (twi_job.index < twi_job.write_len || twi_job.read_len == 0) {
+            TWDR = (twi_job.addr << 1) | WRITE;
+        } else {
+            TWDR = (twi_job.addr << 1) | READ;
+        }
+        TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+        break;
+    case TW_MT_SLA_ACK:
+    case TW_MT_DATA_ACK:
+        if (twi_job.index < twi_job.write_len) {
+            TWDR = twi_job.write[twi_job.index++];
+            TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+        } else if (twi_job.read_len != 0) {
+            TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE);
+        } else {
+            TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
+            twi_job.status = TWI_DONE;
+            events |= EVENT_TWI;
+        }
+        break;
+    case TW_MR_SLA_ACK:
+        //  ACK every byte but the last
+        twi_job.index = 0;
+        if (twi_job.read_len > 1) {
+            TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE) | (1 << TWEA);
+        } else {
+            TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+        }
+        break;
+    case TW_MR_DATA_ACK:
+        twi_job.read[twi_job.index++] = TWDR;
+        if (twi_job.index < twi_job.read_len - 1) {
+            TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE) | (1 << TWEA);
+        } else {
+            TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE);
+        }
+        break;
+    case TW_MR_DATA_NACK:
+        twi_job.read[twi_job.index++] = TWDR;
+        TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
+        twi_job.status = TWI_DONE;
+        events |= EVENT_TWI;
+        break;
+    default:
+        //  address or data NACKed, arbitration lost or bus error
+        TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
+        twi_job.status = TWI_FAILED;
+        events |= EVENT_TWI;
+        break;
+    }
+}
+
+/**
+ * \brief Start a TWI job, returns straight away
+ *
+ * Make sure no job is running (TwiBusy) before calling this function.
+ * If the STOP of the last job does not finish within TWI_TIMEOUT_US the
+ * bus is reset and the job fails with TWI_TIMEOUT.
+ *
+ * \param addr 7 bit device address
+ * \param data bytes to write, at most 2
+ * \param write_len number of bytes to write
+ * \param read_len number of bytes to read, at most 2
+ * \retval Null
+ */
+void TwiStart(uint8_t addr, const uint8_t *data, uint8_t write_len,
+              uint8_t read_len) {
+    uint16_t counter = 0;
+
+    //  let the STOP of the last job finish, a stuck bus holds it forever
+    while (TWCR & (1 << TWSTO)) {
+        _delay_us(10);
+        if (++counter > TWI_TIMEOUT_US/10) {
+            TwiReset();
+            return;
+        }
+    }
+
+    twi_job.addr = addr;
+    twi_job.write_len = write_len;
+    twi_job.read_len = read_len;
+    twi_job.index = 0;
+    memcpy(twi_job.write, data, write_len);
+    twi_job.status = TWI_BUSY;
+    TWCR = (1 << TWINT) | (1 << TWSTA) | (1 << TWEN) | (1 << TWIE);
+}
+
+/**
+ * \brief Check if a TWI job is running
+ * \param Null
+ * \retval true while the job is running
+ */
+bool TwiBusy(void) {
+    return twi_job.status == TWI_BUSY;
+}
+
+/**
+ * \brief Abandon a stuck TWI job and free the bus
+ * \param Null
+ * \retval Null
+ */
+void TwiReset(void) {
+    TWCR = 0;
+    twi_job.status = TWI_TIMEOUT;
+    stats.i2c_timeouts++;
+    TWCR = (1 << TWEN);
+}
+
+/**
+ * \brief Run a TWI job and wait for it to finish
+ *
+ * Needs global interrupts enabled.
+ *
+ * \param addr 7 bit device address
+ * \param data bytes to write, at most 2
+ * \param write_len number of bytes to write
+ * \param read_len number of bytes to read into twi_job.read, at most 2
+ * \retval Return 1 on failure, 3 on time out, 0 on success
+ */
+int TwiRun(uint8_t addr, const uint8_t *data, uint8_t write_len,
+           uint8_t read_len) {
+    uint16_t counter = 0;
+
+    TwiStart(addr, data, write_len, read_len);
+    while (TwiBusy()) {
+        _delay_us(10);
+        if (++counter > TWI_TIMEOUT_US/10) {
+            //  took too long - time out
+            TwiReset();
+            return 3;
+        }
+    }
+    if (twi_job.status == TWI_TIMEOUT) {
+        return 3;  //  the last STOP never finished
+    }
+    return twi_job.status == TWI_DONE ? 0 : 1;
+}
+
+/**
+ * \brief Scan the I2C bus and set up the temp sensors found
+ *
+ * Every address that ACKs is marked in i2c_devices. Devices in the
+ * temp sensor range are polled by TempPoll.
+ *
+ * \param Null
+ * \retval Null
+ */
+void I2cScan(void) {
+    TempPollWait();
+    memset(i2c_devices, 0, sizeof(i2c_devices));
+    temp_sensor_count = 0;
+
+    for (uint8_t addr = 0x08; addr < 0x78; addr++) {
+        //  112 probes of up to TWI_TIMEOUT_US each outlast the watchdog
+        WatchdogFeed();
+        if (TwiRun(addr, NULL, 0, 0) != 0) {
+            continue;
+        }
+        i2c_devices[addr >> 3] |= 1 << (addr & 7);
+        if (addr >= TEMP_ADDR_FIRST && addr <= TEMP_ADDR_LAST) {
+            temp_sensor_addr[temp_sensor_count++] = addr;
+        }
+    }
+    //  idle, TempPollStart starts the next round
+    temp_poll_index = temp_sensor_count;
+
+    TempSetResolution(temp_resolution);
+    TempResetAverage();
+}
+
+/**
+ * \brief Start a new round of temp sensor reads
+ *
+ * Called every acquisition interval. A round that has not finished by
+ * then is cut short and reported with what it has.
+ *
+ * \param Null
+ * \retval Null
+ */
+void TempPollStart(void) {
+    if (temp_poll_index < temp_sensor_count) {
+        TwiReset();
+        temp_poll_index = temp_sensor_count;
+        TempRoundDone();
+    }
+    if (temp_sensor_count == 0) {
+        return;
+    }
+
+    //  read the temperature register of the first sensor
+    const uint8_t command = 0xAA;
+    temp_poll_index = 0;
+    TwiStart(temp_sensor_addr[0], &command, 1, 2);
+    TaskStart(TASK_TEMP_TIMEOUT, TWI_TIMEOUT_US/1000, 0);
+}
+
+/**
+ * \brief Collect finished reads and start the next one
+ *
+ * Called from the main loop, returns straight away while the TWI is busy.
+ *
+ * \param Null
+ * \retval Null
+ */
+void TempPoll(void) {
+    if (temp_poll_index >= temp_sensor_count || TwiBusy()) {
+        return;
+    }
+
+    if (twi_job.status == TWI_DONE) {
+        temp_sum[temp_poll_index] +=
+            (int16_t) (twi_job.read[0] << 8 | twi_job.read[1]);
+        temp_readings[temp_poll_index]++;
+    }
+
+    if (++temp_poll_index < temp_sensor_count) {
+        const uint8_t command = 0xAA;
+        TwiStart(temp_sensor_addr[temp_poll_index], &command, 1, 2);
+        TaskStart(TASK_TEMP_TIMEOUT, TWI_TIMEOUT_US/1000, 0);
+    } else {
+        TaskStop(TASK_TEMP_TIMEOUT);
+        TempRoundDone();
+    }
+}
+
+/**
+ * \brief Abandons a temp sensor read that is taking too long
+ *
+ * One-shot task started with every read. TempPoll then counts the read
+ * as failed and moves on to the next sensor.
+ * \param Null
+ * \retval Null
+ */
+void TempPollTimeout(void) {
+    if (temp_poll_index < temp_sensor_count && TwiBusy()) {
+        TwiReset();
+    }
+}
+
+/**
+ * \brief Wait for a running round of reads to finish with the bus
+ * \param Null
+ * \retval Null
+ */
+void TempPollWait(void) {
+    uint16_t counter = 0;
+
+    while (temp_poll_index < temp_sensor_count) {
+        TempPoll();
+        _delay_us(10);
+        if (++counter > TWI_TIMEOUT_US/10) {
+            //  a read is stuck, give up on the round
+            TwiReset();
+            temp_poll_index = temp_sensor_count;
+            TempRoundDone();
+        }
+    }
+}
+
+/**
+ * \brief Average finished rounds, then log and display them
+ *
+ * After temp_average rounds every sensor's mean is logged and sent as
+ * one line, "23.06 22.50\n", in sensor order. A sensor with no good
+ * reading in the block is sent as "--".
+ *
+ * \param Null
+ * \retval Null
+ */
+void TempRoundDone(void) {
+    if (++temp_rounds < temp_average) {
+        return;
+    }
+
+    char line[TEMP_SENSORS_MAX*8];
+    uint8_t len = 0;
+    for (uint8_t i = 0; i < temp_sensor_count; i++) {
+        if (i > 0) {
+            line[len++] = ' ';
+        }
+        if (temp_readings[i] == 0) {
+            len = ReplyText(line, len, "--");
+            continue;
+        }
+
+        //  rounded mean of the readings
+        int32_t half = temp_readings[i]/2;
+        int16_t sample = (temp_sum[i] + (temp_sum[i] < 0 ? -half : half))/
+                         temp_readings[i];
+        TempLogAdd(i, sample);
+        len = TempFormat(line, len, sample);
+    }
+    line[len++] = '\n';
+    TempResetAverage();
+
+    if (temp_display == 1 && temp_sensor_count > 0) {
+        UartWriteAll(line, len);
+    }
+}
+
+/**
+ * \brief Start a new averaging block
+ * \param Null
+ * \retval Null
+ */
+void TempResetAverage(void) {
+    temp_rounds = 0;
+    memset(temp_sum, 0, sizeof(temp_sum));
+    memset(temp_readings, 0, sizeof(temp_readings));
+}
+
+/**
+ * \brief Add a temperature as degC with two decimals, e.g. "23.06"
+ * \param line the line being built
+ * \param len current length of the line
+ * \param reading temperature in 1/256 degC
+ * \retval new length of the line
+ */
+uint8_t TempFormat(char *line, uint8_t len, int16_t reading) {
+    int32_t centi = reading;
+
+    if (centi < 0) {
+        line[len++] = '-';
+        centi = -centi;
+    }
+    centi = (centi*100 + 128)/256;
+    len = ReplyNumber(line, len, centi/100);
+    line[len++] = '.';
+    line[len++] = (centi/10) % 10 + '0';
+    line[len++] = centi % 10 + '0';
+    return len;
+}
+
+/**
+ * \brief Set the resolution of every temp sensor and start converting
+ *
+ * Writes R1:R0 of the configuration register, leaving the sensors in
+ * continuous conversion. Conversions take 94 ms at 9 bits up to 750 ms
+ * at 12 bits.
+ *
+ * \param bits resolution, 9 to 12
+ * \retval Return 1 on failure, 3 on time out, 0 on success
+ */
+int TempSetResolution(uint8_t bits) {
+    int result = 0;
+
+    TempPollWait();
+
+    for (uint8_t i = 0; i < temp_sensor_count && result == 0; i++) {
+        const uint8_t config[2] = {0xAC, (bits - 9) << 2};
+        const uint8_t convert = 0x51;
+        result = TwiRun(temp_sensor_addr[i], config, 2, 0);
+        if (result == 0) {
+            result = TwiRun(temp_sensor_addr[i], &convert, 1, 0);
+        }
+    }
+    return result;
+}
+
+/**
+ * \brief ADC conversion complete - store one capture sample
+ *
+ * Conversions are started by the Timer0 compare match, so each sample is
+ * the output set by the previous sample interrupt.
+ *
+ * \param None
+ *
+ */
+ISR(ADC_vect) {
+    capture_buffer[capture_count] = ADCH;
+    if (++capture_count >= CAPTURE_SIZE) {
+        //  buffer full, stop converting
+        ADCSRA = 0;
+        capture_state = CAPTURE_DONE;
+    }
+}
+
+/**
+ * \brief Start capturing an ADC channel on every sample tick
+ *
+ * The ADC is auto triggered by the Timer0 compare match, so the capture
+ * runs in lockstep with the waves once CONTINUEE! restarts them.
+ *
+ * \param channel ADC channel with the output looped back, 0 to 7
+ * \retval Null
+ */
+void CaptureStart(uint8_t channel) {
+    ADCSRA = 0;
+    capture_count = 0;
+    capture_channel = channel;
+    capture_state = CAPTURE_RUNNING;
+
+    //  AVcc reference, left adjusted so ADCH holds 8 bits
+    ADMUX = (1 << REFS0) | (1 << ADLAR) | channel;
+    if (channel < 6) {
+        DIDR0 |= (1 << channel);
+    }
+    //  trigger on Timer0 compare match A
+    ADCSRB = (0 << ADTS2) | (1 << ADTS1) | (1 << ADTS0);
+    //  /16 ADC clock (1 MHz, 13 us per conversion), clear ADIF
+    ADCSRA = (1 << ADEN) | (1 << ADATE) | (1 << ADIE) | (1 << ADIF) |
+             (1 << ADPS2);
+}
+
+/**
+ * \brief Measure the captured samples
+ *
+ * The period is taken between the first and last rising crossings of
+ * the mean, with 1/8 of the swing as hysteresis, clamped to the swing.
+ *
+ * \param report filled in with the results
+ * \retval Null
+ */
+void CaptureMeasure(CaptureReport *report) {
+    uint16_t sum = 0;
+    report->min = 255;
+    report->max = 0;
+    for (uint16_t i = 0; i < CAPTURE_SIZE; i++) {
+        uint8_t sample = capture_buffer[i];
+        sum += sample;
+        if (sample < report->min) {
+            report->min = sample;
+        }
+        if (sample > report->max) {
+            report->max = sample;
+        }
+    }
+    report->mean = (sum + CAPTURE_SIZE/2)/CAPTURE_SIZE;
+
+    uint8_t hysteresis = (report->max - report->min)/8;
+    int16_t high = report->mean + hysteresis;
+    int16_t low = report->mean - hysteresis;
+    //  a lopsided wave, e.g. a 90 % pulse, puts the mean near a peak; keep
+    //  the thresholds inside the swing so the peaks still cross them
+    if (high > report->max - 1) {
+        high = report->max - 1;
+    }
+    if (low < report->min + 1) {
+        low = report->min + 1;
+    }
+    bool above = capture_buffer[0] >= report->mean;
+    uint16_t first = 0;
+    uint16_t last = 0;
+    uint16_t rising = 0;
+    for (uint16_t i = 1; i < CAPTURE_SIZE; i++) {
+        uint8_t sample = capture_buffer[i];
+        if (!above && sample > high) {
+            above = true;
+            if (rising++ == 0) {
+                first = i;
+            }
+            last = i;
+        } else if (above && sample < low) {
+            above = false;
+        }
+    }
+
+    report->period_us = 0;
+    if (rising >= 2 && report->max - report->min >= 4) {
+        report->period_us = (last - first)*1000000UL/
+                            ((rising - 1)*(uint32_t) sampling_frequency);
+    }
+}
+
+/**
+ * \brief Add a reading to the temperature log
+ *
+ * When the SRAM log is full the oldest record moves to EEPROM (with
+ * TEMP_LOG_EEPROM defined) or is lost.
+ *
+ * \param sensor index of the sensor
+ * \param reading temperature in 1/256 degC
+ * \retval Null
+ */
+void TempLogAdd(uint8_t sensor, int16_t reading) {
+    TempRecord record;
+
+    record.tick = TickMs()/TEMP_LOG_TICK_MS;
+    record.reading = reading;
+    record.sensor = sensor;
+
+    if (temp_log_count == TEMP_LOG_SIZE) {
+#ifdef TEMP_LOG_EEPROM
+        if (temp_log_ee_count == TEMP_LOG_EEPROM_SIZE) {
+            //  EEPROM full too, drop its oldest record
+            temp_log_ee_first = (temp_log_ee_first + 1) % TEMP_LOG_EEPROM_SIZE;
+            temp_log_ee_count--;
+            temp_log_lost++;
+        }
+        eeprom_update_block(&temp_log[temp_log_first],
+            &temp_log_ee[(temp_log_ee_first + temp_log_ee_count) %
+                         TEMP_LOG_EEPROM_SIZE], sizeof(TempRecord));
+        temp_log_ee_count++;
+#else
+        temp_log_lost++;
+#endif
+        temp_log_first = (temp_log_first + 1) & (TEMP_LOG_SIZE - 1);
+        temp_log_count--;
+    }
+    temp_log[(temp_log_first + temp_log_count) & (TEMP_LOG_SIZE - 1)] = record;
+    temp_log_count++;
+}
+
+/**
+ * \brief Send the temperature log as one line and empty it
+ *
+ * "TL " then the frame in hex (UartWriteHex), then a newline. The frame
+ * is a TEMP_LOG_HEADER_SIZE byte header:
+ *   count u16    records that follow, oldest first
+ *   lost u16     records overwritten since the last download
+ *   tick_us u32  length of one tick in microseconds
+ *   now u32      tick count when the log was sent
+ * followed by count TEMP_RECORD_SIZE byte records:
+ *   tick u16     low word of the tick count the reading was taken on
+ *   reading i16  temperature in 1/256 degC
+ *   sensor u8    index of the sensor in the SCAN! order
+ * Every field is little endian, whatever the compiler's struct layout.
+ *
+ * \param Null
+ * \retval Null
+ */
+void SendTempLog(void) {
+    uint8_t header[TEMP_LOG_HEADER_SIZE];
+    uint8_t len = 0;
+    uint16_t count = temp_log_count;
+
+#ifdef TEMP_LOG_EEPROM
+    count += temp_log_ee_count;
+#endif
+    len = FrameLittleEndian(header, len, count, 2);
+    len = FrameLittleEndian(header, len, temp_log_lost, 2);
+    len = FrameLittleEndian(header, len, TEMP_LOG_TICK_MS*1000UL, 4);
+    len = FrameLittleEndian(header, len, TickMs()/TEMP_LOG_TICK_MS, 4);
+    UartWriteAll("TL ", 3);
+    UartWriteHex(header, len);
+
+#ifdef TEMP_LOG_EEPROM
+    //  the EEPROM holds the older records
+    while (temp_log_ee_count > 0) {
+        TempRecord record;
+        eeprom_read_block(&record, &temp_log_ee[temp_log_ee_first],
+                          sizeof(record));
+        SendTempRecord(&record);
+        temp_log_ee_first = (temp_log_ee_first + 1) % TEMP_LOG_EEPROM_SIZE;
+        temp_log_ee_count--;
+    }
+#endif
+
+    while (temp_log_count > 0) {
+        SendTempRecord(&temp_log[temp_log_first]);
+        temp_log_first = (temp_log_first + 1) & (TEMP_LOG_SIZE - 1);
+        temp_log_count--;
+    }
+    UartWriteAll("\n", 1);
+    temp_log_lost = 0;
+}
+
+/**
+ * \brief Send one record of the LOG! frame, as SendTempLog lays it out
+ * \param record the record to send
+ * \retval Null
+ */
+static void SendTempRecord(const TempRecord *record) {
+    uint8_t frame[TEMP_RECORD_SIZE];
+    uint8_t len = 0;
+
+    len = FrameLittleEndian(frame, len, record->tick, 2);
+    len = FrameLittleEndian(frame, len, (uint16_t) record->reading, 2);
+    len = FrameLittleEndian(frame, len, record->sensor, 1);
+    UartWriteHex(frame, len);
+}
+
+/**
+ * \brief Initializes the TWI clock
+ * \param Null
+ * \retval Null
+ */
+void I2cInit(void) {
+    TWSR = 0;
+    TWBR = ((F_CPU / SCL_CLOCK) - 16) / 2;
+}
+
+
+/**
+ * \brief Initializes the timer interrupts
+ * \param Null
+ * \retval Null
+ */
+void InterruptInit(void) {
+    //  CTC with the pre-scaler as 64, 4 us a count
+    TCCR1B |=  (1 << WGM12)|(0 << CS12)|(1 << CS11) |(1 << CS10);
+    //  interrupt settings
+    TCNT1 = 0;  //  init the counter
+    OCR1A = TICK_OCR;  //  initialize compare register
+    TIMSK1 |= (1  <<  OCIE1A);  //  enable the output compare interrupt
+
+
+    //  interrupt setting for the sampling frequency, the prescaler and
+    //  OCR0A were chosen by PlanSampleRate
+    TCCR0A |= (1 << WGM01);
+    TCNT0 = 0;
+    TIMSK0 |= (1 << OCIE0A);  //  enable the interrup
+}
+
+
+/**
+ * \brief Initialize the waves
+ * \param Null
+ * \retval Null
+ */
+void WaveInit(void) {
+    //  set the output ports for wave 1;
+    DDRD |= (1 << DDD2| 1 << DDD3 | 1 << DDD4 | 1 << DDD5
+    | 1 << DDD6 | 1 << DDD7);
+    DDRC |= (1  <<  DDC0 | 1  <<  DDC1 | 1 <<  DDC2 | 1 <<  DDC3);
+
+    DDRB |= (1 << DDB0 |1  <<  DDB1 | 1 << DDB2 | 1 << DDB3
+    | 1 << DDB4 | 1 << DDB5);
+
+    //  pick the sample rate and step values
+    PlanSampleRate();
+
+    //  pulse duty cycles
+    pulse_duty_1 = waveOne.duty*4294967UL;
+    pulse_duty_2 = waveTwo.duty*4294967UL;
+
+    //  populate wave 1 lookup table
+    PopulateWaveTable(waveOne.amplitude, waveOne.offset, waveOne.frequency,
+    waveOne.wave_type, 1, waveOne.dither);
+
+    //  populate wave 2 lookup table
+    PopulateWaveTable(waveTwo.amplitude, waveTwo.offset, waveTwo.frequency,
+    waveTwo.wave_type, 2, waveTwo.dither);
+}
+
+/**
+ * \brief Starts the watchdog, in interrupt and reset mode
+ *
+ * The first timeout runs WDT_vect, which saves the phase, and the next
+ * one resets the board. With interrupts off the reset comes on the next
+ * timeout and the phase saved last is used.
+ * \param Null
+ * \retval Null
+ */
+void WatchdogInit(void) {
+    wdt_enable(WDT_TIMEOUT);
+    WDTCSR |= (1 << WDIE);
+}
+
+/**
+ * \brief Tells the watchdog the main loop is still going round
+ *
+ * WDIE is set again in case WDT_vect ran and the loop then recovered.
+ * \param Null
+ * \retval Null
+ */
+static inline void WatchdogFeed(void) {
+    wdt_reset();
+    WDTCSR |= (1 << WDIE);
+}
+
+/**
+ * \brief Watchdog timeout - the main loop is stuck, save the phase
+ *
+ * The reset follows on the next timeout.
+ */
+ISR(WDT_vect) {
+    StateSavePhase();
+    saved.check = StateCheck();
+}
+
+/**
+ * \brief Checksum of the saved state
+ * \param Null
+ * \retval rotate and xor of every byte before saved.check
+ */
+uint16_t StateCheck(void) {
+    const uint8_t *byte = (const uint8_t *) &saved;
+    uint16_t check = 0xA55A;  //  so all zero memory does not pass
+
+    for (uint8_t i = 0; i < offsetof(SavedState, check); i++) {
+        check = ((check << 1) | (check >> 15)) ^ byte[i];
+    }
+    return check;
+}
+
+/**
+ * \brief Copies the output phase into the saved state
+ * \param Null
+ * \retval Null
+ */
+void StateSavePhase(void) {
+    saved.index_1 = wave_one_index;
+    saved.index_2 = wave_two_index;
+    saved.pulse_phase_1 = pulse_phase_1;
+    saved.pulse_phase_2 = pulse_phase_2;
+    saved.pulse_duty_1 = pulse_duty_1;
+    saved.pulse_duty_2 = pulse_duty_2;
+    saved.noise_1 = noise_1;
+    saved.noise_2 = noise_2;
+}
+
+/**
+ * \brief Saves the waves the tables were just built from
+ *
+ * Called after every rebuild, so a watchdog reset resumes the last
+ * settings that rendered rather than a half applied command.
+ * \param Null
+ * \retval Null
+ */
+void StateSave(void) {
+    cli();
+    saved.one = waveOne;
+    saved.two = waveTwo;
+    saved.isr_cycles = sample_isr_cycles;
+    saved.clock_mode = clock_mode;
+    saved.clock_top = clock_top;
+    StateSavePhase();
+    saved.check = StateCheck();
+    sei();
+}
+
+/**
+ * \brief Loads the saved waves after a watchdog reset, before WaveInit
+ * \param Null
+ * \retval true if the saved state was used, then call StateRestorePhase
+ *         after WaveInit
+ */
+bool StateRestore(void) {
+    if (!(reset_cause & (1 << WDRF)) || StateCheck() != saved.check) {
+        return false;
+    }
+    waveOne = saved.one;
+    waveTwo = saved.two;
+    //  the planner picks the rate it had before the reset
+    sample_isr_cycles = saved.isr_cycles;
+    clock_mode = saved.clock_mode;
+    clock_top = saved.clock_top;
+    //  as after the command that set the frequencies
+    temp_display = waveOne.frequency < 6000 && waveTwo.frequency < 6000;
+    return true;
+}
+
+/**
+ * \brief Puts the output back to the saved phase, after WaveInit
+ * \param Null
+ * \retval Null
+ */
+void StateRestorePhase(void) {
+    wave_one_index = saved.index_1;
+    wave_two_index = saved.index_2;
+    pulse_phase_1 = saved.pulse_phase_1;
+    pulse_phase_2 = saved.pulse_phase_2;
+    pulse_duty_1 = saved.pulse_duty_1;
+    pulse_duty_2 = saved.pulse_duty_2;
+    noise_1 = saved.noise_1;
+    noise_2 = saved.noise_2;
+}
+
+/**
+ * \brief Clears the recieve buffer
+ * \param Null
+ * \retval Null
+ */
+void ClearReceiveBuffer(void) {
+        memset(&command, 0, sizeof(command));  //  back to PARSE_NAME
+        recieved_byte = 0;  //  ready for the next command
+        reply_tag_len = 0;
+}
+
+/**
+ * \brief Feeds one received byte to the command parser
+ *
+ * The name is the first four characters plus any letters right after
+ * them, so "AM1 01.50", "CAPT6" and "CONTINUEE" all split as before. The
+ * value is decoded as it arrives into thousandths: spaces, a sign, whole
+ * digits, then up to three fraction digits (more are ignored), at any
+ * width. Anything else, a value of 100000 or more, or a name too long
+ * for the buffer puts the parser in PARSE_ERROR until the '!'.
+ * \param byte received byte
+ * \retval true when the byte is the '!' ending the command
+ */
+static bool ParseByte(uint8_t byte) {
+    //  thousandths per digit after the point
+    static const uint8_t fraction_scale[3] = {100, 10, 1};
+
+    if (byte == '!') {
+        return true;
+    }
+
+    if (command.state == PARSE_TAG) {
+        //  "#<seq> " ahead of a command asks for a tagged reply
+        if (byte == ' ') {
+            command.state = PARSE_NAME;
+        } else if (byte < ' ' || byte > '~' || reply_tag_len == REPLY_TAG_MAX) {
+            //  the tag is echoed, it must not put XON/XOFF in the reply,
+            //  and a cut short one would match the wrong command
+            reply_tag_len = 0;
+            command.error = REPLY_ERR_COMMAND;
+            command.state = PARSE_ERROR;
+        } else {
+            reply_tag[reply_tag_len++] = byte;
+        }
+        return false;
+    }
+
+    if (command.state == PARSE_NAME) {
+        if (command.name_len == 0 && reply_tag_len == 0 && byte == '#') {
+            reply_tag[reply_tag_len++] = '#';
+            command.state = PARSE_TAG;
+            return false;
+        }
+        if (command.name_len < 4 || (byte >= 'A' && byte <= 'Z')) {
+            if (command.name_len < COMMAND_NAME_MAX - 1) {
+                command.name[command.name_len++] = byte;
+            } else {
+                command.error = REPLY_ERR_COMMAND;
+                command.state = PARSE_ERROR;
+            }
+            return false;
+        }
+        command.state = PARSE_VALUE;
+    }
+
+    if (command.state == PARSE_ERROR) {
+        return false;
+    }
+
+    if (byte >= '0' && byte <= '9') {
+        uint8_t digit = byte - '0';
+        if (command.state == PARSE_VALUE) {
+            if (command.value >= PARSE_VALUE_LIMIT/10) {
+                command.error = REPLY_ERR_VALUE;
+                command.state = PARSE_ERROR;
+                return false;
+            }
+            command.value = command.value*10 + digit*1000L;
+        } else if (command.fraction_digits < sizeof(fraction_scale)) {
+            command.value += digit*fraction_scale[command.fraction_digits++];
+        }
+        command.has_value = true;
+    } else if (byte == '.' && command.state == PARSE_VALUE) {
+        command.state = PARSE_FRACTION;
+    } else if ((byte == '-' || byte == '+') && !command.has_sign &&
+               !command.has_value && command.state == PARSE_VALUE) {
+        command.has_sign = true;
+        command.negative = (byte == '-');
+    } else if (byte == ' ' && !command.has_sign && !command.has_value) {
+        //  padding between the name and the value
+    } else {
+        command.error = REPLY_ERR_VALUE;
+        command.state = PARSE_ERROR;
+    }
+    return false;
+}
+
+/**
+ * \brief Looks up and runs the command that just ended with '!'
+ *
+ * The opcode, the first two letters of the name, is hashed into
+ * command_index, so the lookup costs the same however many commands
+ * there are. Wave commands take the wave number after the opcode
+ * ("AM1"), others must match their table name in full.
+ * \retval 0 once the command ran, else the REPLY_ERR_ code
+ */
+static uint8_t RunCommand(void) {
+    CommandEntry entry;
+    Wave *wave = NULL;
+    uint8_t len = command.name_len;
+    uint8_t slot = CommandHash(command.name[0], command.name[1]);
+    uint8_t index;
+
+    //  "LOG !" and the like, the space is not part of the name
+    while (len > 0 && command.name[len - 1] == ' ') {
+        command.name[--len] = 0;
+    }
+
+    while ((index = command_index[slot]) != 0) {
+        memcpy_P(&entry, &commands[index - 1], sizeof(entry));
+        if (entry.name[0] == command.name[0] &&
+            entry.name[1] == command.name[1] &&
+            ((entry.flags & COMMAND_WAVE) ||
+             strcmp(entry.name, command.name) == 0)) {
+            break;
+        }
+        slot = (slot + 1) & (COMMAND_HASH_SIZE - 1);
+    }
+    if (index == 0) {
+        return REPLY_ERR_COMMAND;
+    }
+
+    if (entry.flags & COMMAND_WAVE) {
+        if (command.name[2] == '1') {
+            wave = &waveOne;
+        } else if (command.name[2] == '2') {
+            wave = &waveTwo;
+        } else {
+            return REPLY_ERR_COMMAND;
+        }
+    }
+
+    long value = command.negative ? -command.value : command.value;
+    if (entry.flags & COMMAND_INT) {
+        value -= value % 1000;  //  whole numbers, as strtol read them
+    }
+    if (((entry.flags & COMMAND_VALUE) && !command.has_value) ||
+        value < entry.min || value > entry.max) {
+        return REPLY_ERR_VALUE;
+    }
+
+    uint8_t error = entry.set(wave, entry.field, value);
+    if (error == 0 && (entry.flags & COMMAND_ACK)) {
+        send_ack = 1;
+        if (entry.flags & COMMAND_REBUILD) {
+            rebuild_waves = 1;
+        }
+    }
+    return error;
+}
+
+/**
+ * \brief Opcode hash, the slot in command_index to start looking at
+ */
+static uint8_t CommandHash(char first, char second) {
+    return (first*3 + second) & (COMMAND_HASH_SIZE - 1);
+}
+
+/**
+ * \brief Fills command_index from the command table
+ */
+void CommandInit(void) {
+    for (uint8_t i = 0; i < COMMAND_COUNT; i++) {
+        uint8_t slot = CommandHash(pgm_read_byte(&commands[i].name[0]),
+                                   pgm_read_byte(&commands[i].name[1]));
+        while (command_index[slot] != 0) {
+            slot = (slot + 1) & (COMMAND_HASH_SIZE - 1);
+        }
+        command_index[slot] = i + 1;
+    }
+}
+
+/**
+ * \brief Sets a float member of a wave, in volts
+ */
+static uint8_t SetWaveFloat(Wave *wave, uint8_t field, long value) {
+    *(float *) ((uint8_t *) wave + field) = value/1000.0;
+    return 0;
+}
+
+/**
+ * \brief Sets an int member of a wave
+ */
+static uint8_t SetWaveInt(Wave *wave, uint8_t field, long value) {
+    *(int *) ((uint8_t *) wave + field) = value/1000;
+    return 0;
+}
+
+/**
+ * \brief Pulse duty cycle in %, takes effect without a rebuild
+ */
+static uint8_t SetDuty(Wave *wave, uint8_t field, long value) {
+    int duty = (value + 50)/100;
+
+    wave->duty = duty;
+    if (wave == &waveOne) {
+        pulse_duty_1 = duty*4294967UL;
+    } else {
+        pulse_duty_2 = duty*4294967UL;
+    }
+    return 0;
+}
+
+/**
+ * \brief Pulse duty sweep in % per second
+ */
+static uint8_t SetSweep(Wave *wave, uint8_t field, long value) {
+    int sweep = value/100;
+
+    wave->sweep = sweep;
+    if (wave == &waveOne) {
+        pulse_sweep_1 = PulseSweepStep(sweep);
+    } else {
+        pulse_sweep_2 = PulseSweepStep(sweep);
+    }
+    return 0;
+}
+
+/**
+ * \brief Restarts the interrupts stopped while commands arrive
+ */
+static uint8_t SetContinue(Wave *wave, uint8_t field, long value) {
+    continuee = 1;
+    return 0;
+}
+
+/**
+ * \brief Reports the planned sample rate
+ */
+static uint8_t SetSendRate(Wave *wave, uint8_t field, long value) {
+    send_rate = 1;
+    return 0;
+}
+
+/**
+ * \brief Reports the performance counters
+ */
+static uint8_t SetSendStats(Wave *wave, uint8_t field, long value) {
+    send_stats = 1;
+    return 0;
+}
+
+/**
+ * \brief Clears the performance counters
+ */
+static uint8_t SetClearStats(Wave *wave, uint8_t field, long value) {
+    cli();
+    memset((void *) &stats, 0, sizeof(stats));
+    sei();
+    sample_isr_ticks = 0;
+    sample_isr_cycles = 0;
+    for (uint8_t i = 0; i < TASKS; i++) {
+        tasks[i].runs = 0;
+        tasks[i].total_us = 0;
+        tasks[i].max_us = 0;
+    }
+    return 0;
+}
+
+/**
+ * \brief Sets a channel's calibration mode, gain or offset, kept in EEPROM
+ * \param field 'M' mode, 'G' gain or 'O' offset (thousandths of a code)
+ */
+static uint8_t SetDacCal(Wave *wave, uint8_t field, long value) {
+    uint8_t channel = (wave == &waveOne) ? 0 : 1;
+    DacCal *cal = &dac_cal[channel];
+
+    if (field == 'M') {
+        cal->mode = value/1000;
+    } else if (field == 'G') {
+        cal->gain = value;
+    } else {
+        cal->offset = value;
+    }
+    DacCalUpdate(channel);
+    eeprom_update_block(cal, &dac_cal_ee[channel], sizeof(DacCal));
+    return 0;
+}
+
+/**
+ * \brief Picks the correction table entry CV! writes next
+ */
+static uint8_t SetDacIndex(Wave *wave, uint8_t field, long value) {
+    dac_upload_index[(wave == &waveOne) ? 0 : 1] = value/1000;
+    return 0;
+}
+
+/**
+ * \brief Writes a correction table entry and moves on to the next
+ *
+ * The tables are rebuilt with the new entries by the next command that
+ * rebuilds them, e.g. CM1 2!.
+ */
+static uint8_t SetDacEntry(Wave *wave, uint8_t field, long value) {
+    uint8_t channel = (wave == &waveOne) ? 0 : 1;
+    uint8_t index = dac_upload_index[channel]++;
+
+    eeprom_update_byte(&dac_table_ee[channel][index], value/1000);
+    return 0;
+}
+
+/**
+ * \brief Reports a channel's calibration for the host to verify
+ */
+static uint8_t SetSendDac(Wave *wave, uint8_t field, long value) {
+    send_dac = (wave == &waveOne) ? 1 : 2;
+    return 0;
+}
+
+/**
+ * \brief Restarts the waves from phase zero when CONTINUEE! starts them
+ */
+static uint8_t SetPhase(Wave *wave, uint8_t field, long value) {
+    phase_reset = true;
+    return 0;
+}
+
+#ifdef SAMPLE_CLOCK
+/**
+ * \brief Sets the board's role in a rig, or the locked sample period
+ * \param field 'M' CLOCK_ mode or 'T' period in 0.5 us steps
+ */
+static uint8_t SetClock(Wave *wave, uint8_t field, long value) {
+    if (field == 'T') {
+        clock_top = value/1000;
+    } else {
+        clock_mode = value/1000;
+        ClockInit();
+    }
+    return 0;
+}
+
+/**
+ * \brief Sets Timer0 and the clock pins up for clock_mode
+ *
+ * A master runs Timer0 in fast PWM up to OCR0A so OC0B puts out a pulse
+ * at the start of every sample; the others run it in CTC. The rate is
+ * set by PlanSampleRate.
+ * \param Null
+ * \retval Null
+ */
+void ClockInit(void) {
+    DDRD &= ~(1 << PD4);  //  T0 is only ever an input
+    if (clock_mode == CLOCK_MASTER) {
+        TCCR0A = (1 << COM0B1) | (1 << WGM01) | (1 << WGM00);
+        TCCR0B |= (1 << WGM02);
+    } else {
+        TCCR0A = (1 << WGM01);
+        TCCR0B &= ~(1 << WGM02);
+    }
+}
+#endif
+
+#ifdef SYNC_PORT
+/**
+ * \brief Picks the wave whose period the sync output marks
+ */
+static uint8_t SetSync(Wave *wave, uint8_t field, long value) {
+    sync_wave = value/1000;
+    return 0;
+}
+#endif
+
+#ifdef TRIGGER_INT
+/**
+ * \brief Sets what the trigger input does, a TRIGGER_ mode
+ */
+static uint8_t SetTrigger(Wave *wave, uint8_t field, long value) {
+    trigger_mode = value/1000;
+    EIFR = (1 << TRIGGER_INT);
+    if (trigger_mode == TRIGGER_RESET) {
+        EIMSK |= (1 << TRIGGER_INT);
+    } else {
+        //  TRIGGER_START arms it at CONTINUEE!
+        EIMSK &= ~(1 << TRIGGER_INT);
+    }
+    return 0;
+}
+#endif
+
+/**
+ * \brief Reports the run time of every task
+ */
+static uint8_t SetSendTasks(Wave *wave, uint8_t field, long value) {
+    send_tasks = 1;
+    return 0;
+}
+
+/**
+ * \brief Temp sensor resolution, 9 to 12 bits
+ */
+static uint8_t SetTempResolution(Wave *wave, uint8_t field, long value) {
+    if (TempSetResolution(value/1000) != 0) {
+        return REPLY_ERR_DEVICE;
+    }
+    temp_resolution = value/1000;
+    return 0;
+}
+
+/**
+ * \brief Temp acquisition interval, 0.1 s to 60 s
+ */
+static uint8_t SetTempInterval(Wave *wave, uint8_t field, long value) {
+    temp_interval = value/1000;
+    TaskStart(TASK_TEMP, temp_interval*100U, temp_interval*100U);
+    return 0;
+}
+
+/**
+ * \brief Rounds averaged into each reported temp sample
+ */
+static uint8_t SetTempAverage(Wave *wave, uint8_t field, long value) {
+    temp_average = value/1000;
+    TempResetAverage();
+    return 0;
+}
+
+/**
+ * \brief Downloads the temperature log
+ */
+static uint8_t SetSendLog(Wave *wave, uint8_t field, long value) {
+    send_log = 1;
+    return 0;
+}
+
+/**
+ * \brief Rescans the I2C bus
+ */
+static uint8_t SetSendScan(Wave *wave, uint8_t field, long value) {
+    send_scan = 1;
+    return 0;
+}
+
+/**
+ * \brief Captures an ADC channel, runs after CONTINUEE!
+ */
+static uint8_t SetCapture(Wave *wave, uint8_t field, long value) {
+    CaptureStart(value/1000);
+    return 0;
+}
+
+/**
+ * \brief Capture results (CAPR!) or raw samples (CAPD!), once finished
+ */
+static uint8_t SetSendCapture(Wave *wave, uint8_t field, long value) {
+    if (capture_state != CAPTURE_DONE) {
+        return REPLY_ERR_BUSY;
+    }
+    if (field == 'R') {
+        send_capture = 1;
+    } else {
+        send_capture_data = 1;
+    }
+    return 0;
+}
+
+
+/**
+ * \brief Sends ack or err
+ * \param Null
+ * \retval Null
+ */
+void SendReply(void) {
+    if (format_error != 0) {  //  send err and clear buffer
+        if (reply_tag_len == 0) {
+            UartWriteAll(err, sizeof(err) - 1);  //  send "ERR\n" back
+        } else {
+            //  send "#<seq> ERR <code>\n" back
+            char reply[12];
+            uint8_t len = 0;
+            ReplyTag();
+            len = ReplyText(reply, len, "ERR ");
+            len = ReplyNumber(reply, len, format_error);
+            reply[len++] = '\n';
+            UartWriteAll(reply, len);
+        }
+        format_error = 0;
+        ClearReceiveBuffer();
+    }
+
+    if (send_ack == 1) {
+        //  send ack and clear buffer, update lookup tables
+        if (rebuild_waves == 1) {
+            rebuild_waves = 0;
+
+            //  no temperature output while high frequency waves are running
+            if (waveOne.frequency >= 6000 || waveTwo.frequency >= 6000) {
+                temp_display = 0;
+                } else {
+                temp_display = 1;
+            }
+
+            //  pick the sample rate and step values for the new frequencies
+            PlanSampleRate();
+
+            // populate the new waves
+            PopulateWaveTable(waveOne.amplitude, waveOne.offset,
+            waveOne.frequency, waveOne.wave_type, 1, waveOne.dither);
+
+            PopulateWaveTable(waveTwo.amplitude, waveTwo.offset,
+            waveTwo.frequency, waveTwo.wave_type, 2, waveTwo.dither);
+
+            //  resume these after a watchdog reset
+            StateSave();
+        }
 
         send_ack = 0;
-        for (int cnt = 0; cnt < strlen(ack); cnt++) {  //  send "ACK\n" back
-            UartPutChar(ack[cnt]);
+        ReplyTag();
+        UartWriteAll(ack, sizeof(ack) - 1);  //  send "ACK\n" back
+        ClearReceiveBuffer();
+    }
+
+    if (send_rate == 1) {
+        //  send "FS <rate> E1 <ppm> E2 <ppm> ISR <cycles> M1 <m> M2 <m>\n"
+        char reply[64];
+        uint8_t len = 0;
+        send_rate = 0;
+        ReplyTag();
+        len = ReplyText(reply, len, "FS ");
+        len = ReplyNumber(reply, len, sampling_frequency);
+        len = ReplyText(reply, len, " E1 ");
+        len = ReplyNumber(reply, len, wave_error_1);
+        len = ReplyText(reply, len, " E2 ");
+        len = ReplyNumber(reply, len, wave_error_2);
+        len = ReplyText(reply, len, " ISR ");
+        len = ReplyNumber(reply, len, SampleIsrCycles());
+        len = ReplyText(reply, len, " M1 ");
+        reply[len++] = wave_mode_1;
+        len = ReplyText(reply, len, " M2 ");
+        reply[len++] = wave_mode_2;
+        reply[len++] = '\n';
+        UartWriteAll(reply, len);
+        ClearReceiveBuffer();
+    }
+
+    if (send_stats == 1) {
+        //  send "ST <samples> <isr cycles> <missed> <rx drops> <tx high>
+        //  <i2c timeouts> <render us>\n" back
+        Stats copy;
+        char reply[64];
+        uint8_t len = 0;
+        send_stats = 0;
+        cli();
+        memcpy(&copy, (const void *) &stats, sizeof(copy));
+        sei();
+        ReplyTag();
+        len = ReplyText(reply, len, "ST ");
+        len = ReplyNumber(reply, len,
+                          ((uint32_t) copy.samples_high << 16) | copy.samples_low);
+        len = ReplyText(reply, len, " ");
+        len = ReplyNumber(reply, len, SampleIsrCycles());
+        len = ReplyText(reply, len, " ");
+        len = ReplyNumber(reply, len, copy.missed);
+        len = ReplyText(reply, len, " ");
+        len = ReplyNumber(reply, len, copy.rx_drops);
+        len = ReplyText(reply, len, " ");
+        len = ReplyNumber(reply, len, copy.tx_high);
+        len = ReplyText(reply, len, " ");
+        len = ReplyNumber(reply, len, copy.i2c_timeouts);
+        len = ReplyText(reply, len, " ");
+        len = ReplyNumber(reply, len, copy.render_us);
+        reply[len++] = '\n';
+        UartWriteAll(reply, len);
+        ClearReceiveBuffer();
+    }
+
+    if (send_tasks == 1) {
+        //  send "TK <name> <runs> <mean us> <max us> ...\n" for every task
+        char reply[64];
+        uint8_t len = 0;
+        send_tasks = 0;
+        ReplyTag();
+        len = ReplyText(reply, len, "TK");
+        for (uint8_t i = 0; i < TASKS; i++) {
+            const Task *task = &tasks[i];
+            if (len > sizeof(reply) - 40) {
+                UartWriteAll(reply, len);
+                len = 0;
+            }
+            len = ReplyText(reply, len, " ");
+            len = ReplyText(reply, len, task->name);
+            len = ReplyText(reply, len, " ");
+            len = ReplyNumber(reply, len, task->runs);
+            len = ReplyText(reply, len, " ");
+            len = ReplyNumber(reply, len,
+                              task->runs ? task->total_us/task->runs : 0);
+            len = ReplyText(reply, len, " ");
+            len = ReplyNumber(reply, len, task->max_us);
+        }
+        reply[len++] = '\n';
+        UartWriteAll(reply, len);
+        ClearReceiveBuffer();
+    }
+
+    if (send_scan == 1) {
+        //  send "SC <addr> <addr> ...\n" with every address in hex
+        char reply[4 + 3*TEMP_SENSORS_MAX*2];
+        uint8_t len = 0;
+        send_scan = 0;
+        I2cScan();
+        ReplyTag();
+        len = ReplyText(reply, len, "SC");
+        for (uint8_t addr = 0x08; addr < 0x78; addr++) {
+            if (i2c_devices[addr >> 3] & (1 << (addr & 7))) {
+                if (len > sizeof(reply) - 4) {
+                    UartWriteAll(reply, len);
+                    len = 0;
+                }
+                reply[len++] = ' ';
+                reply[len++] = "0123456789ABCDEF"[addr >> 4];
+                reply[len++] = "0123456789ABCDEF"[addr & 15];
+            }
+        }
+        reply[len++] = '\n';
+        UartWriteAll(reply, len);
+        ClearReceiveBuffer();
+    }
+
+    if (send_capture == 1) {
+        //  send "CP <channel> <min> <max> <mean> <period us>\n"
+        CaptureReport report;
+        char reply[32];
+        uint8_t len = 0;
+        send_capture = 0;
+        CaptureMeasure(&report);
+        ReplyTag();
+        len = ReplyText(reply, len, "CP ");
+        len = ReplyNumber(reply, len, capture_channel);
+        len = ReplyText(reply, len, " ");
+        len = ReplyNumber(reply, len, report.min);
+        len = ReplyText(reply, len, " ");
+        len = ReplyNumber(reply, len, report.max);
+        len = ReplyText(reply, len, " ");
+        len = ReplyNumber(reply, len, report.mean);
+        len = ReplyText(reply, len, " ");
+        len = ReplyNumber(reply, len, report.period_us);
+        reply[len++] = '\n';
+        UartWriteAll(reply, len);
+        ClearReceiveBuffer();
+    }
+
+    if (send_capture_data == 1) {
+        //  send "CD <hex>\n", the hex (UartWriteHex) of the sample count
+        //  u16, the sample rate u16, both little endian, the channel u8,
+        //  then the raw samples
+        uint8_t header[5];
+        uint8_t len = 0;
+        send_capture_data = 0;
+        len = FrameLittleEndian(header, len, CAPTURE_SIZE, 2);
+        len = FrameLittleEndian(header, len, sampling_frequency, 2);
+        len = FrameLittleEndian(header, len, capture_channel, 1);
+        ReplyTag();
+        UartWriteAll("CD ", 3);
+        UartWriteHex(header, len);
+        for (uint16_t sent = 0; sent < CAPTURE_SIZE; sent += 128) {
+            UartWriteHex(&capture_buffer[sent], 128);
         }
+        UartWriteAll("\n", 1);
+        ClearReceiveBuffer();
+    }
+
+    if (send_dac != 0) {
+        //  send "CK <mode> <gain> <offset> <table checksum>\n", gain and
+        //  offset in thousandths
+        const DacCal *cal = &dac_cal[send_dac - 1];
+        char reply[40];
+        uint8_t len = 0;
+        ReplyTag();
+        len = ReplyText(reply, len, "CK ");
+        len = ReplyNumber(reply, len, cal->mode);
+        len = ReplyText(reply, len, " ");
+        len = ReplyNumber(reply, len, cal->gain);
+        len = ReplyText(reply, len, " ");
+        len = ReplyNumber(reply, len, cal->offset);
+        len = ReplyText(reply, len, " ");
+        len = ReplyNumber(reply, len, DacTableCheck(send_dac - 1));
+        reply[len++] = '\n';
+        send_dac = 0;
+        UartWriteAll(reply, len);
+        ClearReceiveBuffer();
+    }
+
+    if (send_log == 1) {
+        //  send the temperature log as one hex frame, "TL <hex>\n"
+        send_log = 0;
+        ReplyTag();
+        SendTempLog();
         ClearReceiveBuffer();
     }
 
     if (continuee == 1) {
+        if (phase_reset) {
+            //  start from phase zero, on a master the sync pin starts the
+            //  slaves waiting with TRIG 2!
+            phase_reset = false;
+            cli();
+            PhaseReset();
+            sei();
+        }
+
         //  restart interrupts
-        for (int cnt = 0; cnt < strlen(recieved_string); cnt++) {
-            // clear buffer
-            recieved_string[cnt] = 0;
+#ifdef TRIGGER_INT
+        if (trigger_mode == TRIGGER_START) {
+            //  the trigger starts the output
+            EIFR = (1 << TRIGGER_INT);
+            EIMSK |= (1 << TRIGGER_INT);
+        } else {
+            TIMSK0 |= (1 << OCIE0A);
         }
+#else
         TIMSK0 |= (1 << OCIE0A);
-        TIMSK1 |= (1 << OCIE1A);
-        recieved_string_index = 0;
+#endif
+        tasks_held = false;
         continuee = 0;
     }
 }
@@ -962,6 +3347,166 @@ void SendReply(void) {
 
 
 
+/**
+ * \brief Next sample of a noise wave
+ *
+ * The LFSR is stepped 8 times so every sample gets 8 fresh bits. Pink noise
+ * adds the white sample to PINK_ROWS octave rows, row n being refreshed
+ * every 2^(n+1) samples (Voss-McCartney). Each term is 5 bits, so the sum
+ * stays within 0-248 and indexes the scaled buffer directly.
+ * \param noise state, NOISEWAVE or PINKWAVE
+ * \retval index into the wave buffer
+ */
+static inline uint8_t NoiseStep(Noise *noise, uint8_t type) {
+    uint16_t lfsr = noise->lfsr;
+
+    for (uint8_t i = 0; i < 8; i++) {
+        if (lfsr & 1) {
+            lfsr = (lfsr >> 1) ^ LFSR_TAPS;
+        } else {
+            lfsr >>= 1;
+        }
+    }
+    noise->lfsr = lfsr;
+
+    if (type == NOISEWAVE) {
+        return lfsr;
+    }
+
+    //  refresh the row of the lowest set bit of the counter
+    uint8_t count = ++noise->count;
+    uint8_t row = 0;
+    while (!(count & 1) && row < PINK_ROWS - 1) {
+        count >>= 1;
+        row++;
+    }
+    uint8_t fresh = (lfsr >> 8) & 0x1F;
+    noise->sum += fresh - noise->rows[row];
+    noise->rows[row] = fresh;
+
+    return noise->sum + (lfsr & 0x1F);
+}
+
+
+/**
+ * \brief Writes the samples at the current indexes to the ladders
+ *
+ * Shared by the sample interrupt and the trigger, which puts phase zero
+ * out as soon as it has reset the indexes.
+ * \param Null
+ * \retval Null
+ */
+static inline void SampleOut(void) {
+    // get the wave 1 value
+    if (dither_1 != 0) {
+        //  add the fraction the last sample dropped and drop this one's,
+        //  the quantisation noise moves up towards the sample rate
+        //  (about 20 more cycles)
+        uint16_t level = current_wave.levels[wave_one_index >> 1] +
+                         dither_error_1;
+        wave_out_1 = level >> 8;
+        dither_error_1 = level;
+    } else {
+        wave_out_1 = current_wave.codes[wave_one_index];
+    }
+    // write value to ports
+    temp_b = PORTB;
+    temp_b &= 0b11000000;
+    temp_b |= (wave_out_1 & 0b11111100)>>2;
+
+    temp_c = PORTC;
+    temp_c &= 0b11110011;  //  apply bit mas
+    temp_c |= (wave_out_1 & 0b00000011) << 2;
+
+    //  get wave 2 value
+    if (dither_2 != 0) {
+        uint16_t level = current_2_wave.levels[wave_two_index >> 1] +
+                         dither_error_2;
+        wave_out_2 = level >> 8;
+        dither_error_2 = level;
+    } else {
+        wave_out_2 = current_2_wave.codes[wave_two_index];
+    }
+
+    //  write value to ports
+    tempD = PORTD;
+    tempD &= ~WAVE_2_PORTD;
+    tempD |= (wave_out_2 & WAVE_2_PORTD);
+
+    temp_c &= 0b11111100;
+    temp_c |= (wave_out_2 & 0b00000011);
+
+    PORTB = temp_b;
+    PORTC = temp_c;
+    PORTD = tempD;
+}
+
+/**
+ * \brief Restarts both waves from phase zero, straight away
+ *
+ * Phase zero goes out now and Timer0 restarts, so the next sample
+ * follows a whole sample period later. The sync pin marks it. Noise
+ * waves carry on, they have no phase.
+ * \param Null
+ * \retval Null
+ */
+static inline void PhaseReset(void) {
+    TCNT0 = 0;
+    TIFR0 = (1 << OCF0A);
+    wave_one_index = 0;
+    current_count_1 = 0;
+    sample_count_1 = 0;
+    pulse_phase_1 = 0;
+    dither_error_1 = 0;
+    if (pulse_1 != 0) {
+        wave_one_index = (pulse_duty_1 != 0) ? 255 : 0;
+    }
+
+    wave_two_index = 0;
+    current_count_2 = 0;
+    sample_count_2 = 0;
+    pulse_phase_2 = 0;
+    dither_error_2 = 0;
+    if (pulse_2 != 0) {
+        wave_two_index = (pulse_duty_2 != 0) ? 255 : 0;
+    }
+    SampleOut();
+#ifdef SYNC_PORT
+    SYNC_PORT |= (1 << SYNC_BIT);
+    sync_index = 0;  //  no second sync pulse for the first step
+#endif
+}
+
+#ifdef TRIGGER_INT
+/**
+ * \brief Trigger input edge - restart the waves from phase zero
+ *
+ * In TRIGGER_START mode the edge also starts the output held by
+ * CONTINUEE!. Wired to a master's sync pin, slaves set to TRIG 2! start
+ * with the master's PHASE!.
+ */
+ISR(TRIGGER_vect) {
+    PhaseReset();
+    if (trigger_mode == TRIGGER_START) {
+        //  one start for each CONTINUEE!
+        EIMSK &= ~(1 << TRIGGER_INT);
+        TIMSK0 |= (1 << OCIE0A);
+    }
+}
+
+/**
+ * \brief Sets up the trigger input, rising edges, no pull-up
+ * \param Null
+ * \retval Null
+ */
+void TriggerInit(void) {
+    DDRD &= ~(1 << TRIGGER_PIN);
+    PORTD &= ~(1 << TRIGGER_PIN);
+    EICRA |= (1 << (ISC00 + 2*TRIGGER_INT)) | (1 << (ISC01 + 2*TRIGGER_INT));
+}
+#endif
+
+
 /**
  * \brief 45kHz Sampling Rate Interrupt to output wave
  * \param Null
@@ -969,10 +3514,26 @@ void SendReply(void) {
  */
 ISR(TIMER0_COMPA_vect) {
     current_count_1++;  //  increment repeat count
-    one_second_counter++;
+
+    //  count the sample, the high word only on carry
+    if (++stats.samples_low == 0) {
+        stats.samples_high++;
+    }
 
     // wave 1 freq code
-    if (repeat_count_1 != 0) {  //  if we are in repeat mode
+    if (noise_type_1 != 0) {  //  if we are a noise wave
+        wave_one_index = NoiseStep(&noise_1, noise_type_1);
+    } else if (pulse_1 != 0) {  //  if we are a pulse wave
+        pulse_phase_1 += pulse_step_1;
+        pulse_duty_1 += pulse_sweep_1;
+        wave_one_index = (pulse_phase_1 < pulse_duty_1) ? 255 : 0;
+    } else if (period_last_1 != 0) {  //  if we loop one exact period
+        if (wave_one_index == period_last_1) {
+            wave_one_index = 0;
+        } else {
+            wave_one_index++;
+        }
+    } else if (repeat_count_1 != 0) {  //  if we are in repeat mode
         if (sample_count_1 <= threshold_rep_1) {
             //  if we are repeating base number of times.
             if (current_count_1 >= repeat_count_1) {
@@ -1012,7 +3573,19 @@ ISR(TIMER0_COMPA_vect) {
 
     //  wave two frequency code
     current_count_2++;
-    if (repeat_count_2 != 0) {  //  if we are in repeat mode
+    if (noise_type_2 != 0) {  //  if we are a noise wave
+        wave_two_index = NoiseStep(&noise_2, noise_type_2);
+    } else if (pulse_2 != 0) {  //  if we are a pulse wave
+        pulse_phase_2 += pulse_step_2;
+        pulse_duty_2 += pulse_sweep_2;
+        wave_two_index = (pulse_phase_2 < pulse_duty_2) ? 255 : 0;
+    } else if (period_last_2 != 0) {  //  if we loop one exact period
+        if (wave_two_index == period_last_2) {
+            wave_two_index = 0;
+        } else {
+            wave_two_index++;
+        }
+    } else if (repeat_count_2 != 0) {  //  if we are in repeat mode
         if (sample_count_2 <= threshold_rep_2) {
             //  if we are repeating base number of times.
             if (current_count_2 >= repeat_count_2) {
@@ -1033,7 +3606,7 @@ ISR(TIMER0_COMPA_vect) {
         }
     } else if (inverse_repeat_2 != 0) {
         //  if we are in skip mode
-        if (sample_count_2 <= threshold_skip_2 || inverse_repeat_2 > 40) {
+        if (sample_count_2 <= threshold_skip_2) {
             //  skipping base number of times
             wave_two_index = wave_two_index + inverse_repeat_2;
             sample_count_2++;
@@ -1048,31 +3621,34 @@ ISR(TIMER0_COMPA_vect) {
             sample_count_2 = 0;
         }
     }
-    // get the wave 1 value
-    wave_out_1 = current_wave[wave_one_index];
-    // write value to ports
-    temp_b = PORTB;
-    temp_b &= 0b11000000;
-    temp_b |= (wave_out_1 & 0b11111100)>>2;
-
-    temp_c = PORTC;
-    temp_c &= 0b11110011;  //  apply bit mas
-    temp_c |= (wave_out_1 & 0b00000011) << 2;
-
-    //  get wave 2 value
-    wave_out_2 = current_2_wave[wave_two_index];
-
-    //  write value to ports
-    tempD = PORTD;
-    tempD &= 0b00000011;
-    tempD |= (wave_out_2 & 0b11111100);
+    SampleOut();
+
+#ifdef SYNC_PORT
+    //  a period starts when the index goes back, or a pulse phase carries
+    uint8_t index = (sync_wave == 1) ? wave_one_index : wave_two_index;
+    bool wrapped = (sync_wave == 1) ?
+                   (pulse_1 ? pulse_phase_1 < pulse_step_1 : index < sync_index) :
+                   (sync_wave == 2) ?
+                   (pulse_2 ? pulse_phase_2 < pulse_step_2 : index < sync_index) :
+                   false;
+    sync_index = index;
+    if (wrapped) {
+        SYNC_PORT |= (1 << SYNC_BIT);
+    } else {
+        SYNC_PORT &= ~(1 << SYNC_BIT);
+    }
+#endif
 
-    temp_c &= 0b11111100;
-    temp_c |= (wave_out_2 & 0b00000011);
+    //  track the ISR length for the sample rate planner
+    uint8_t ticks = TCNT0;
+    if (ticks > sample_isr_ticks) {
+        sample_isr_ticks = ticks;
+    }
 
-    PORTB = temp_b;
-    PORTC = temp_c;
-    PORTD = tempD;
+    //  another compare match already happened, a sample was late
+    if (TIFR0 & (1 << OCF0A)) {
+        stats.missed++;
+    }
 }
 
 
@@ -0,0 +1,351 @@
+/**
+ * \file
+ *
+ * \brief Power-of-two ring buffer with bulk access
+ *
+ * Companion to ring_buffer.h for buffers whose size is a power of two.
+ * The offsets run freely and are masked on access, so wrapping is a single
+ * AND instead of a compare and branch, and the whole buffer can be filled
+ * (count == size) without the one byte gap ring_buffer.h needs.
+ *
+ * Define RING_BUFFER_P2_16BIT before including this file to use 16 bit
+ * offsets and buffers of up to 32768 bytes; the default 8 bit offsets
+ * allow up to 128 bytes.
+ */
+#ifndef RING_BUFFER_P2_H_INCLUDED
+#define RING_BUFFER_P2_H_INCLUDED
+
+#include <string.h>
+#include "compiler.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \defgroup ring_buffer_p2_group Power-of-two ring buffer
+ *
+ * Same single producer / single consumer rules as \ref ring_buffer_group:
+ * one side (e.g. an ISR) only moves write_offset, the other only moves
+ * read_offset, and each offset is published once per call after the data
+ * has been copied.
+ *
+ * \section dependencies Dependencies
+ * This ring buffer does not depend on other modules.
+ * @{
+ */
+
+#ifdef RING_BUFFER_P2_16BIT
+typedef uint16_t ring_p2_index_t;
+#else
+typedef uint8_t ring_p2_index_t;
+#endif
+
+/**
+ * \brief Struct for holding the ring buffer
+ *
+ * \note The size must be a power of two, at most 128 bytes with 8 bit
+ *       offsets or 32768 bytes with 16 bit offsets
+ */
+struct ring_buffer_p2 {
+	volatile ring_p2_index_t write_offset;
+	volatile ring_p2_index_t read_offset;
+	ring_p2_index_t mask;
+	uint8_t *buffer;
+};
+
+/**
+ * \brief Function for reading an offset the other side may be changing
+ *
+ * 16 bit offsets are read with interrupts off so an ISR can not change
+ * them half way through; 8 bit offsets are read directly.
+ *
+ * \param offset pointer to the offset to read
+ *
+ * \returns the offset
+ */
+static inline ring_p2_index_t ring_buffer_p2_load(
+		const volatile ring_p2_index_t *offset)
+{
+#ifdef RING_BUFFER_P2_16BIT
+	irqflags_t flags = cpu_irq_save();
+	ring_p2_index_t value = *offset;
+	cpu_irq_restore(flags);
+	return value;
+#else
+	return *offset;
+#endif
+}
+
+/**
+ * \brief Function for publishing a new offset to the other side
+ *
+ * 16 bit offsets are written with interrupts off so an ISR never sees
+ * half of the update; 8 bit offsets are written directly.
+ *
+ * \param offset pointer to the offset to write
+ * \param value  the new offset
+ */
+static inline void ring_buffer_p2_store(volatile ring_p2_index_t *offset,
+		ring_p2_index_t value)
+{
+	barrier();
+#ifdef RING_BUFFER_P2_16BIT
+	irqflags_t flags = cpu_irq_save();
+	*offset = value;
+	cpu_irq_restore(flags);
+#else
+	*offset = value;
+#endif
+}
+
+/**
+ * \brief Function for getting the number of bytes in the ring buffer
+ *
+ * \param ring pointer to a struct of type ring_buffer_p2
+ *
+ * \returns bytes waiting to be read
+ */
+static inline ring_p2_index_t ring_buffer_p2_count(
+		const struct ring_buffer_p2 *ring)
+{
+	return ring_buffer_p2_load(&ring->write_offset) -
+			ring_buffer_p2_load(&ring->read_offset);
+}
+
+/**
+ * \brief Function for getting the free room in the ring buffer
+ *
+ * \param ring pointer to a struct of type ring_buffer_p2
+ *
+ * \returns bytes that can still be written
+ */
+static inline ring_p2_index_t ring_buffer_p2_free(
+		const struct ring_buffer_p2 *ring)
+{
+	return ring->mask + 1 - ring_buffer_p2_count(ring);
+}
+
+/**
+ * \brief Function for checking if the ring buffer is full
+ *
+ * \param ring pointer to a struct of type ring_buffer_p2
+ *
+ * \retval true  if the buffer is full
+ * \retval false if there is space available in the ring buffer
+ */
+static inline bool ring_buffer_p2_is_full(const struct ring_buffer_p2 *ring)
+{
+	return ring_buffer_p2_count(ring) == (ring_p2_index_t)(ring->mask + 1);
+}
+
+/**
+ * \brief Function for checking if the ring buffer is empty
+ *
+ * \param ring pointer to a struct of type ring_buffer_p2
+ *
+ * \retval true   if the buffer is empty
+ * \retval false  if there is still data in the buffer
+ */
+static inline bool ring_buffer_p2_is_empty(const struct ring_buffer_p2 *ring)
+{
+	return ring_buffer_p2_count(ring) == 0;
+}
+
+/**
+ * \brief Function for initializing a ring buffer
+ *
+ * \param buffer pointer to the buffer to use as a ring buffer
+ * \param size   the size of the ring buffer, a power of two
+ *
+ * \retval struct ring_buffer_p2 a struct containing the ring buffer
+ */
+static inline struct ring_buffer_p2 ring_buffer_p2_init(uint8_t *buffer,
+		ring_p2_index_t size)
+{
+	struct ring_buffer_p2 ring;
+	Assert(size != 0 && (size & (size - 1)) == 0);
+	ring.write_offset = 0;
+	ring.read_offset = 0;
+	ring.mask = size - 1;
+	ring.buffer = buffer;
+	return ring;
+}
+
+/**
+ * \brief Function for getting one byte from the ring buffer
+ *
+ * Make sure buffer is not empty (using \ref ring_buffer_p2_is_empty)
+ * before calling this function.
+ *
+ * \param ring pointer to a struct of type ring_buffer_p2
+ *
+ * \returns next data byte in buffer
+ */
+static inline uint8_t ring_buffer_p2_get(struct ring_buffer_p2 *ring)
+{
+	Assert(!ring_buffer_p2_is_empty(ring));
+	ring_p2_index_t offset = ring->read_offset;
+	uint8_t data = ring->buffer[offset & ring->mask];
+	ring_buffer_p2_store(&ring->read_offset, offset + 1);
+	return data;
+}
+
+/**
+ * \brief Function for putting a data byte in the ring buffer
+ *
+ * Make sure buffer is not full (using \ref ring_buffer_p2_is_full)
+ * before calling this function.
+ *
+ * \param ring pointer to a struct of type ring_buffer_p2
+ * \param data the byte to put to the buffer
+ */
+static inline void ring_buffer_p2_put(struct ring_buffer_p2 *ring,
+		uint8_t data)
+{
+	Assert(!ring_buffer_p2_is_full(ring));
+	ring_p2_index_t offset = ring->write_offset;
+	ring->buffer[offset & ring->mask] = data;
+	ring_buffer_p2_store(&ring->write_offset, offset + 1);
+}
+
+/**
+ * \brief Function for getting the contiguous data at the read offset
+ *
+ * Gives direct access to the bytes that can be read without wrapping.
+ * Call \ref ring_buffer_p2_consume once they have been used.
+ *
+ * \param ring pointer to a struct of type ring_buffer_p2
+ * \param data set to the first readable byte
+ *
+ * \returns number of contiguous bytes at data
+ */
+static inline ring_p2_index_t ring_buffer_p2_read_span(
+		const struct ring_buffer_p2 *ring, const uint8_t **data)
+{
+	ring_p2_index_t offset = ring->read_offset & ring->mask;
+	ring_p2_index_t count = ring_buffer_p2_count(ring);
+	ring_p2_index_t span = ring->mask + 1 - offset;
+
+	*data = &ring->buffer[offset];
+	return count < span ? count : span;
+}
+
+/**
+ * \brief Function for dropping bytes from the read side of the ring buffer
+ *
+ * \param ring pointer to a struct of type ring_buffer_p2
+ * \param len  number of bytes to drop, at most \ref ring_buffer_p2_count
+ */
+static inline void ring_buffer_p2_consume(struct ring_buffer_p2 *ring,
+		ring_p2_index_t len)
+{
+	Assert(len <= ring_buffer_p2_count(ring));
+	ring_buffer_p2_store(&ring->read_offset, ring->read_offset + len);
+}
+
+/**
+ * \brief Function for getting the contiguous room at the write offset
+ *
+ * Gives direct access to the room that can be written without wrapping.
+ * Call \ref ring_buffer_p2_commit once it has been filled.
+ *
+ * \param ring pointer to a struct of type ring_buffer_p2
+ * \param data set to the first writable byte
+ *
+ * \returns number of contiguous bytes at data
+ */
+static inline ring_p2_index_t ring_buffer_p2_write_span(
+		const struct ring_buffer_p2 *ring, uint8_t **data)
+{
+	ring_p2_index_t offset = ring->write_offset & ring->mask;
+	ring_p2_index_t room = ring_buffer_p2_free(ring);
+	ring_p2_index_t span = ring->mask + 1 - offset;
+
+	*data = &ring->buffer[offset];
+	return room < span ? room : span;
+}
+
+/**
+ * \brief Function for publishing bytes written through a write span
+ *
+ * \param ring pointer to a struct of type ring_buffer_p2
+ * \param len  number of bytes written, at most \ref ring_buffer_p2_free
+ */
+static inline void ring_buffer_p2_commit(struct ring_buffer_p2 *ring,
+		ring_p2_index_t len)
+{
+	Assert(len <= ring_buffer_p2_free(ring));
+	ring_buffer_p2_store(&ring->write_offset, ring->write_offset + len);
+}
+
+/**
+ * \brief Function for putting a block of data in the ring buffer
+ *
+ * Copies as much as fits, in at most two pieces, and publishes the new
+ * write offset once.
+ *
+ * \param ring pointer to a struct of type ring_buffer_p2
+ * \param data the bytes to put to the buffer
+ * \param len  number of bytes
+ *
+ * \returns number of bytes written, less than len if the buffer filled up
+ */
+static inline ring_p2_index_t ring_buffer_p2_write_bulk(
+		struct ring_buffer_p2 *ring, const uint8_t *data,
+		ring_p2_index_t len)
+{
+	ring_p2_index_t room = ring_buffer_p2_free(ring);
+	ring_p2_index_t offset = ring->write_offset & ring->mask;
+	ring_p2_index_t first = ring->mask + 1 - offset;
+
+	if (len > room) {
+		len = room;
+	}
+	if (first > len) {
+		first = len;
+	}
+	memcpy(&ring->buffer[offset], data, first);
+	memcpy(ring->buffer, data + first, len - first);
+	ring_buffer_p2_store(&ring->write_offset, ring->write_offset + len);
+	return len;
+}
+
+/**
+ * \brief Function for getting a block of data from the ring buffer
+ *
+ * Copies as much as is waiting, in at most two pieces, and publishes the
+ * new read offset once.
+ *
+ * \param ring pointer to a struct of type ring_buffer_p2
+ * \param data where to put the bytes
+ * \param len  maximum number of bytes
+ *
+ * \returns number of bytes read, less than len if the buffer ran empty
+ */
+static inline ring_p2_index_t ring_buffer_p2_read_bulk(
+		struct ring_buffer_p2 *ring, uint8_t *data, ring_p2_index_t len)
+{
+	ring_p2_index_t count = ring_buffer_p2_count(ring);
+	ring_p2_index_t offset = ring->read_offset & ring->mask;
+	ring_p2_index_t first = ring->mask + 1 - offset;
+
+	if (len > count) {
+		len = count;
+	}
+	if (first > len) {
+		first = len;
+	}
+	memcpy(data, &ring->buffer[offset], first);
+	memcpy(data + first, ring->buffer, len - first);
+	ring_buffer_p2_store(&ring->read_offset, ring->read_offset + len);
+	return len;
+}
+
+//! @}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RING_BUFFER_P2_H_INCLUDED */
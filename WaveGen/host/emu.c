@@ -0,0 +1,473 @@
+/*
+ *  Title: WaveGen emulator core
+ *  File : emu.c
+ *  Target : Linux host
+ */
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include <avr/io.h>
+#include <util/twi.h>
+
+#include "emu.h"
+#include "hal_host.h"
+
+#define EMU_SAMPLE_ISR_CYCLES 160  // modelled length of the sample ISR
+#define EMU_TWI_BIT_CYCLES (EMU_F_CPU/100000)  // 100 kHz SCL
+#define TWCR_OWNED 0x100  // set by the emulator, cleared by firmware writes
+
+//  the firmware's interrupt handlers
+void shim_vect_timer0_compa(void);
+void shim_vect_timer1_compa(void);
+void shim_vect_usart_rx(void);
+void shim_vect_usart_udre(void);
+void shim_vect_twi(void);
+void shim_vect_adc(void);
+
+//  where a TWI transfer is
+enum {TWI_IDLE, TWI_ADDRESS, TWI_WRITE, TWI_READ};
+
+//  one DS1631 on the bus
+typedef struct {
+    uint8_t addr;
+    double celsius;
+    uint8_t config;  //  configuration register, R1:R0 in bits 3:2
+    uint8_t command;  //  last command byte, selects what a read returns
+    uint8_t first;  //  next written byte is a command
+    uint8_t index;  //  bytes read since the address
+} Sensor;
+
+static EmuHooks hooks;
+static uint64_t now;  //  virtual CPU cycles
+static uint64_t byte_cycles;  //  one UART frame
+static uint64_t timer0_next;  //  0 while the timer is stopped
+static uint64_t timer1_next;
+static uint64_t uart_tx_next;
+static uint64_t uart_rx_next;
+static uint64_t twi_done;  //  when the running TWI action completes
+static int twi_pending;
+static uint8_t twi_status;  //  TWSR once the action completes
+static int twi_phase;
+static int twi_bus_owned;
+static Sensor *twi_device;
+static int adc_pending;
+static Sensor sensors[EMU_SENSORS_MAX];
+static int sensor_count;
+static double wall_start;
+static jmp_buf stop_jump;
+
+static double WallNow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/**
+ * \brief Timer prescaler from the CS bits, 0 if stopped
+ */
+static uint32_t Prescaler(uint8_t tccrb) {
+    static const uint16_t prescalers[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+
+    return prescalers[tccrb & 7];
+}
+
+/**
+ * \brief CPU cycles per Timer0 count, 0 if stopped
+ *
+ * CS0 6 and 7 count edges on T0, which come from EmuHooks.t0_hz.
+ */
+static uint32_t Timer0Cycles(void) {
+    if ((TCCR0B & 7) >= 6) {
+        return hooks.t0_hz > 0 ? lround(EMU_F_CPU/hooks.t0_hz) : 0;
+    }
+    return Prescaler(TCCR0B);
+}
+
+static int InterruptsOn(void) {
+    return (SREG & (1 << SREG_I)) != 0;
+}
+
+static void TwiCommand(void);
+
+/**
+ * \brief Call an ISR the way the AVR does, with interrupts off
+ */
+static void Call(void (*isr)(void)) {
+    uint8_t sreg = SREG;
+
+    SREG = sreg & ~(1 << SREG_I);
+    isr();
+    SREG = (SREG & ~(1 << SREG_I)) | (sreg & (1 << SREG_I));
+
+    //  the ISR may have written a TWI command, e.g. a STOP
+    TwiCommand();
+}
+
+uint8_t EmuWaveOut(int wave) {
+    if (wave == 1) {
+        return (PORTB & 0x3F) << 2 | (PORTC >> 2 & 0x03);
+    }
+    return (PORTD & 0xFC) | (PORTC & 0x03);
+}
+
+uint64_t EmuCycles(void) {
+    return now;
+}
+
+int EmuAddSensor(uint8_t addr, double celsius) {
+    if (sensor_count == EMU_SENSORS_MAX) {
+        return -1;
+    }
+    Sensor *sensor = &sensors[sensor_count++];
+    memset(sensor, 0, sizeof(*sensor));
+    sensor->addr = addr;
+    sensor->celsius = celsius;
+    sensor->config = 0x0C;  //  12 bits at power up
+    return 0;
+}
+
+/**
+ * \brief Temperature register of a sensor, at its resolution
+ *
+ * The temperature drifts by a quarter of a degree over a minute so
+ * averaging has something to do.
+ */
+static int16_t SensorReading(const Sensor *sensor) {
+    double seconds = (double) now/EMU_F_CPU;
+    double celsius = sensor->celsius + 0.25*sin(2*M_PI*seconds/60);
+    int bits = 9 + (sensor->config >> 2 & 3);
+    int16_t reading = (int16_t) lround(celsius*256);
+
+    return reading & ~((1 << (16 - bits)) - 1);
+}
+
+static void SensorWrite(Sensor *sensor, uint8_t data) {
+    if (sensor->first) {
+        sensor->command = data;
+        sensor->first = 0;
+    } else if (sensor->command == 0xAC) {
+        sensor->config = data;
+    }
+}
+
+static uint8_t SensorRead(Sensor *sensor) {
+    if (sensor->command == 0xAC) {
+        return sensor->config;
+    }
+    int16_t reading = SensorReading(sensor);
+    return sensor->index++ == 0 ? (uint16_t) reading >> 8 : reading & 0xFF;
+}
+
+static Sensor *FindSensor(uint8_t addr) {
+    for (int i = 0; i < sensor_count; i++) {
+        if (sensors[i].addr == addr) {
+            return &sensors[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * \brief Act on a TWCR write, if the firmware made one
+ *
+ * The emulator sets TWCR_OWNED in TWCR; any write by the firmware clears
+ * it, which is how a new command (TWINT written as 1) is told apart from
+ * a flag that is still set.
+ */
+static void TwiCommand(void) {
+    uint16_t twcr = TWCR;
+
+    if (twcr & TWCR_OWNED) {
+        return;
+    }
+    TWCR = twcr | TWCR_OWNED;
+    if (!(twcr & (1 << TWEN)) || !(twcr & (1 << TWINT))) {
+        //  disabled or reset, drop whatever was going on
+        twi_pending = 0;
+        if (!(twcr & (1 << TWEN))) {
+            twi_bus_owned = 0;
+            twi_phase = TWI_IDLE;
+        }
+        return;
+    }
+
+    uint64_t delay = 9*EMU_TWI_BIT_CYCLES;
+    TWCR &= ~(1 << TWINT);
+    if (twcr & (1 << TWSTA)) {
+        twi_status = twi_bus_owned ? TW_REP_START : TW_START;
+        twi_bus_owned = 1;
+        twi_phase = TWI_ADDRESS;
+        delay = EMU_TWI_BIT_CYCLES;
+    } else if (twcr & (1 << TWSTO)) {
+        //  STOP needs no interrupt, TWSTO clears once it is sent
+        twi_bus_owned = 0;
+        twi_phase = TWI_IDLE;
+        twi_device = NULL;
+        twi_pending = 0;
+        TWCR &= ~(1 << TWSTO);
+        return;
+    } else if (twi_phase == TWI_ADDRESS) {
+        uint8_t sla = TWDR;
+        int read = sla & 1;
+        twi_device = FindSensor(sla >> 1);
+        if (twi_device == NULL) {
+            twi_status = read ? TW_MR_SLA_NACK : TW_MT_SLA_NACK;
+            twi_phase = TWI_IDLE;
+        } else if (read) {
+            twi_status = TW_MR_SLA_ACK;
+            twi_phase = TWI_READ;
+            twi_device->index = 0;
+        } else {
+            twi_status = TW_MT_SLA_ACK;
+            twi_phase = TWI_WRITE;
+            twi_device->first = 1;
+        }
+    } else if (twi_phase == TWI_WRITE) {
+        SensorWrite(twi_device, TWDR);
+        twi_status = TW_MT_DATA_ACK;
+    } else if (twi_phase == TWI_READ) {
+        TWDR = SensorRead(twi_device);
+        twi_status = (twcr & (1 << TWEA)) ? TW_MR_DATA_ACK : TW_MR_DATA_NACK;
+    } else {
+        twi_status = TW_BUS_ERROR;
+    }
+    twi_done = now + delay;
+    twi_pending = 1;
+}
+
+static void TwiComplete(void) {
+    twi_pending = 0;
+    TWSR = twi_status;
+    TWCR |= (1 << TWINT);
+    if ((TWCR & (1 << TWIE)) && InterruptsOn()) {
+        Call(shim_vect_twi);
+    }
+}
+
+static void Timer0Match(void) {
+    int edge = !(TIFR0 & (1 << OCF0A));
+
+    //  the ADC samples the pins as they were before the ISR runs
+    TIFR0 |= (1 << OCF0A);
+    if (edge && (ADCSRA & (1 << ADEN)) && (ADCSRA & (1 << ADATE)) &&
+        (ADCSRB & 7) == 3) {
+        uint8_t channel = ADMUX & 0x0F;
+        uint8_t value = channel == 6 ? EmuWaveOut(1) :
+                        channel == 7 ? EmuWaveOut(2) : 0;
+        ADC = value << 8;
+        ADCH = value;
+        ADCL = 0;
+        adc_pending = 1;
+    }
+
+    if ((TIMSK0 & (1 << OCIE0A)) && InterruptsOn()) {
+        TIFR0 &= ~(1 << OCF0A);
+        TCNT0 = EMU_SAMPLE_ISR_CYCLES/Timer0Cycles();
+        Call(shim_vect_timer0_compa);
+        TCNT0 = 0;
+        if (hooks.sample != NULL) {
+            hooks.sample(hooks.context);
+        }
+    }
+
+    if (adc_pending) {
+        adc_pending = 0;
+        ADCSRA |= (1 << ADIF);
+        if ((ADCSRA & (1 << ADIE)) && InterruptsOn()) {
+            ADCSRA &= ~(1 << ADIF);
+            Call(shim_vect_adc);
+        }
+    }
+}
+
+static void Timer1Match(void) {
+    TIFR1 |= (1 << OCF1A);
+    if ((TIMSK1 & (1 << OCIE1A)) && InterruptsOn()) {
+        TIFR1 &= ~(1 << OCF1A);
+        Call(shim_vect_timer1_compa);
+    }
+}
+
+static void UartTransmit(void) {
+    uart_tx_next = now + byte_cycles;
+    if (!InterruptsOn()) {
+        return;
+    }
+    UDR0 = 0xFFFF;
+    Call(shim_vect_usart_udre);
+    if (UDR0 != 0xFFFF && hooks.uart_tx != NULL) {
+        hooks.uart_tx(UDR0 & 0xFF, hooks.context);
+    }
+}
+
+static void UartReceive(void) {
+    uart_rx_next = now + byte_cycles;
+    if (!(UCSR0B & (1 << RXCIE0)) || !InterruptsOn() || hooks.uart_rx == NULL) {
+        return;
+    }
+    int data = hooks.uart_rx(hooks.context);
+    if (data >= 0) {
+        UDR0 = data;
+        Call(shim_vect_usart_rx);
+    }
+}
+
+/**
+ * \brief Bring the timer schedules up to date with their registers
+ */
+static void Schedule(void) {
+    uint32_t prescaler0 = Timer0Cycles();
+    uint32_t prescaler1 = Prescaler(TCCR1B);
+
+    if (prescaler0 == 0) {
+        timer0_next = 0;
+    } else if (timer0_next == 0) {
+        timer0_next = now + (uint64_t) prescaler0*(OCR0A + 1);
+    }
+    if (prescaler1 == 0) {
+        timer1_next = 0;
+    } else if (timer1_next == 0) {
+        timer1_next = now + (uint64_t) prescaler1*(OCR1A + 1);
+    }
+    if ((UCSR0B & (1 << UDRIE0)) && uart_tx_next < now) {
+        uart_tx_next = now;
+    }
+}
+
+/**
+ * \brief The earliest pending event, at most limit
+ */
+static uint64_t NextEvent(uint64_t limit) {
+    uint64_t next = limit;
+
+    if (timer0_next != 0 && timer0_next < next) {
+        next = timer0_next;
+    }
+    if (timer1_next != 0 && timer1_next < next) {
+        next = timer1_next;
+    }
+    if ((UCSR0B & (1 << UDRIE0)) && uart_tx_next < next) {
+        next = uart_tx_next;
+    }
+    if (uart_rx_next < next) {
+        next = uart_rx_next;
+    }
+    if (twi_pending && twi_done < next) {
+        next = twi_done;
+    }
+    return next;
+}
+
+/**
+ * \brief Hold the virtual clock back to speed times real time
+ */
+static void Pace(void) {
+    if (hooks.speed <= 0) {
+        return;
+    }
+    double wait = wall_start + now/(double) EMU_F_CPU/hooks.speed - WallNow();
+    if (wait > 0.001) {
+        struct timespec ts = {(time_t) wait, (long) ((wait - (long) wait)*1e9)};
+        nanosleep(&ts, NULL);
+    }
+}
+
+/**
+ * \brief Run the peripherals until the clock reaches target
+ * \param stop_early return after the first event instead
+ */
+static void RunUntil(uint64_t target, int stop_early) {
+    for (;;) {
+        TwiCommand();
+        Schedule();
+        uint64_t next = NextEvent(target);
+        if (next > now) {
+            now = next;
+            Pace();
+        }
+
+        int fired = 0;
+        if (timer0_next != 0 && timer0_next <= now) {
+            timer0_next += (uint64_t) Timer0Cycles()*(OCR0A + 1);
+            Timer0Match();
+            fired = 1;
+        }
+        if (timer1_next != 0 && timer1_next <= now) {
+            timer1_next += (uint64_t) Prescaler(TCCR1B)*(OCR1A + 1);
+            Timer1Match();
+            fired = 1;
+        }
+        if ((UCSR0B & (1 << UDRIE0)) && uart_tx_next <= now) {
+            UartTransmit();
+            fired = 1;
+        }
+        if (uart_rx_next <= now) {
+            UartReceive();
+            fired = 1;
+        }
+        if (twi_pending && twi_done <= now) {
+            TwiComplete();
+            fired = 1;
+        }
+
+        //  Timer1 counts up to OCR1A, the firmware reads it for timing
+        uint32_t prescaler1 = Prescaler(TCCR1B);
+        if (prescaler1 != 0 && timer1_next != 0) {
+            uint64_t period = (uint64_t) prescaler1*(OCR1A + 1);
+            TCNT1 = (now + period - timer1_next)/prescaler1 % (OCR1A + 1);
+        }
+
+        if (now >= target || (stop_early && fired)) {
+            return;
+        }
+    }
+}
+
+void HalIdle(void) {
+    RunUntil(UINT64_MAX, 1);
+}
+
+void HalDelayUs(double us) {
+    RunUntil(now + (uint64_t) (us*(EMU_F_CPU/1000000)), 0);
+}
+
+void EmuInit(const EmuHooks *init) {
+    hooks = *init;
+    if (hooks.baud <= 0) {
+        hooks.baud = 9600;
+    }
+    memset((void *) shim_io, 0, sizeof(shim_io));
+    memset((void *) shim_io16, 0, sizeof(shim_io16));
+    TWCR = TWCR_OWNED;
+
+    now = 0;
+    byte_cycles = 10*EMU_F_CPU/hooks.baud;
+    timer0_next = 0;
+    timer1_next = 0;
+    uart_tx_next = 0;
+    uart_rx_next = byte_cycles;
+    twi_pending = 0;
+    twi_phase = TWI_IDLE;
+    twi_bus_owned = 0;
+    adc_pending = 0;
+    sensor_count = 0;
+    wall_start = WallNow();
+}
+
+void EmuRun(int (*firmware)(void)) {
+    if (setjmp(stop_jump) == 0) {
+        wall_start = WallNow() - now/(double) EMU_F_CPU/
+                     (hooks.speed > 0 ? hooks.speed : 1);
+        firmware();
+    }
+}
+
+void EmuStop(void) {
+    longjmp(stop_jump, 1);
+}
@@ -0,0 +1,70 @@
+/*
+ *  Title: WaveGen emulator core
+ *  File : emu.h
+ *  Target : Linux host
+ *
+ *  Runs the real firmware (main.c built with -DWAVEGEN_HOST against the
+ *  shim) on a virtual clock. The firmware's main loop calls HalIdle and
+ *  _delay_* where it waits; there the emulator moves the clock on to the
+ *  next peripheral event and calls the ISRs, as the AVR would have.
+ *
+ *  Modelled: Timer0 CTC sample clock, from the prescaler or from a clock
+ *  on T0 (EmuHooks.t0_hz), Timer1 CTC tick, the UART at the
+ *  configured baud rate, the TWI with DS1631 temperature sensors, and the
+ *  ADC auto triggered by Timer0 (channel 6 reads wave 1, channel 7
+ *  wave 2, as if looped back).
+ */
+#ifndef EMU_H_INCLUDED
+#define EMU_H_INCLUDED
+
+#include <stdint.h>
+
+#define EMU_F_CPU 16000000UL
+#define EMU_SENSORS_MAX 8
+
+typedef struct {
+    double speed;  // virtual seconds per wall second, 0 for flat out
+    long baud;  // UART speed, 9600 like the board
+    void (*uart_tx)(uint8_t byte, void *context);  // byte sent by the board
+    int (*uart_rx)(void *context);  // next byte for the board, -1 if none
+    void (*sample)(void *context);  // after every sample interrupt
+    void *context;
+    double t0_hz;  // rising edges on T0 per second, 0 for none
+} EmuHooks;
+
+/**
+ * \brief Reset the virtual MCU
+ */
+void EmuInit(const EmuHooks *hooks);
+
+/**
+ * \brief Put a DS1631 temperature sensor on the I2C bus
+ * \param addr 7 bit address
+ * \param celsius temperature it reads
+ * \retval 0 on success, -1 if the bus is full
+ */
+int EmuAddSensor(uint8_t addr, double celsius);
+
+/**
+ * \brief Run the firmware until EmuStop is called
+ * \param firmware the firmware's main, built as firmware_main
+ */
+void EmuRun(int (*firmware)(void));
+
+/**
+ * \brief Leave EmuRun, from a hook
+ */
+void EmuStop(void);
+
+/**
+ * \brief Virtual CPU cycles since EmuInit
+ */
+uint64_t EmuCycles(void);
+
+/**
+ * \brief The value the R-2R ladder of a wave is driven to
+ * \param wave 1 or 2
+ */
+uint8_t EmuWaveOut(int wave);
+
+#endif /* EMU_H_INCLUDED */
@@ -0,0 +1,133 @@
+/*
+ *  Title: Ring buffer benchmark
+ *  File : ring_buffer_bench.c
+ *  Target : Linux host
+ *
+ *  Pushes the same byte stream through ring_buffer.h and ring_buffer_p2.h
+ *  and prints the time per byte. Each round fills the buffer with CHUNK
+ *  bytes and drains it again, the way a UART reply is queued and sent.
+ *  The numbers compare the algorithms on the host, not AVR cycles.
+ */
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ring_buffer.h"
+#include "ring_buffer_p2.h"
+
+#define BUFFER_SIZE 64  // same size for every variant
+#define CHUNK 48  // bytes queued per round
+#define BYTES 200000000UL  // bytes pushed through each variant
+
+static uint8_t storage[BUFFER_SIZE];
+static uint8_t message[CHUNK];
+static uint8_t received[CHUNK];
+
+/**
+ * \brief Seconds on the monotonic clock
+ */
+static double Now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/**
+ * \brief Print the result of one variant
+ */
+static void Report(const char *name, double seconds, unsigned long sum) {
+    printf("%-28s %6.3f ns/byte  (checksum %lu)\n",
+           name, seconds*1e9/BYTES, sum);
+}
+
+/**
+ * \brief ring_buffer.h, one byte per call
+ */
+static void BenchOriginal(void) {
+    struct ring_buffer ring = ring_buffer_init(storage, BUFFER_SIZE);
+    unsigned long sum = 0;
+    double start = Now();
+
+    for (unsigned long done = 0; done < BYTES; done += CHUNK) {
+        for (int i = 0; i < CHUNK; i++) {
+            ring_buffer_put(&ring, message[i]);
+        }
+        while (!ring_buffer_is_empty(&ring)) {
+            sum += ring_buffer_get(&ring);
+        }
+    }
+    Report("ring_buffer put/get", Now() - start, sum);
+}
+
+/**
+ * \brief ring_buffer_p2.h, one byte per call
+ */
+static void BenchPow2(void) {
+    struct ring_buffer_p2 ring = ring_buffer_p2_init(storage, BUFFER_SIZE);
+    unsigned long sum = 0;
+    double start = Now();
+
+    for (unsigned long done = 0; done < BYTES; done += CHUNK) {
+        for (int i = 0; i < CHUNK; i++) {
+            ring_buffer_p2_put(&ring, message[i]);
+        }
+        while (!ring_buffer_p2_is_empty(&ring)) {
+            sum += ring_buffer_p2_get(&ring);
+        }
+    }
+    Report("ring_buffer_p2 put/get", Now() - start, sum);
+}
+
+/**
+ * \brief ring_buffer_p2.h, bulk write and read
+ */
+static void BenchPow2Bulk(void) {
+    struct ring_buffer_p2 ring = ring_buffer_p2_init(storage, BUFFER_SIZE);
+    unsigned long sum = 0;
+    double start = Now();
+
+    for (unsigned long done = 0; done < BYTES; done += CHUNK) {
+        ring_buffer_p2_write_bulk(&ring, message, CHUNK);
+        ring_buffer_p2_read_bulk(&ring, received, CHUNK);
+        sum += received[done % CHUNK];
+    }
+    Report("ring_buffer_p2 bulk", Now() - start, sum);
+}
+
+/**
+ * \brief ring_buffer_p2.h, bulk write and span reads
+ */
+static void BenchPow2Span(void) {
+    struct ring_buffer_p2 ring = ring_buffer_p2_init(storage, BUFFER_SIZE);
+    unsigned long sum = 0;
+    double start = Now();
+
+    for (unsigned long done = 0; done < BYTES; done += CHUNK) {
+        const uint8_t *data;
+        ring_p2_index_t len;
+
+        ring_buffer_p2_write_bulk(&ring, message, CHUNK);
+        while ((len = ring_buffer_p2_read_span(&ring, &data)) != 0) {
+            sum += data[len - 1];
+            ring_buffer_p2_consume(&ring, len);
+        }
+    }
+    Report("ring_buffer_p2 bulk/span", Now() - start, sum);
+}
+
+int main(void) {
+    for (int i = 0; i < CHUNK; i++) {
+        message[i] = rand();
+    }
+
+    printf("%d byte buffer, %d byte rounds, %lu bytes, %d bit p2 offsets\n",
+           BUFFER_SIZE, CHUNK, BYTES, (int) sizeof(ring_p2_index_t)*8);
+    BenchOriginal();
+    BenchPow2();
+    BenchPow2Bulk();
+    BenchPow2Span();
+    return 0;
+}
@@ -0,0 +1,40 @@
+/*
+ *  Title: Host shim for <avr/eeprom.h>
+ *  File : eeprom.h
+ *  Target : Linux host builds of the firmware
+ */
+#ifndef SHIM_AVR_EEPROM_H
+#define SHIM_AVR_EEPROM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+//  EEPROM variables are ordinary RAM on the host, lost at exit
+#define EEMEM
+
+static inline void eeprom_read_block(void *dst, const void *src, size_t n) {
+    memcpy(dst, src, n);
+}
+
+static inline void eeprom_update_block(const void *src, void *dst, size_t n) {
+    memcpy(dst, src, n);
+}
+
+static inline uint8_t eeprom_read_byte(const uint8_t *addr) {
+    return *addr;
+}
+
+static inline void eeprom_update_byte(uint8_t *addr, uint8_t value) {
+    *addr = value;
+}
+
+static inline uint16_t eeprom_read_word(const uint16_t *addr) {
+    return *addr;
+}
+
+static inline void eeprom_update_word(uint16_t *addr, uint16_t value) {
+    *addr = value;
+}
+
+#endif  // SHIM_AVR_EEPROM_H
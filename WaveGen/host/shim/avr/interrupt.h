@@ -0,0 +1,16 @@
+/*
+ *  Title: Host shim for <avr/interrupt.h>
+ *  File : interrupt.h
+ *  Target : Linux host builds of the firmware
+ */
+#ifndef SHIM_AVR_INTERRUPT_H
+#define SHIM_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+//  an ISR is a plain function the host calls itself
+#define ISR(vect, ...) void vect(void)
+#define sei() (SREG |= (1 << SREG_I))
+#define cli() (SREG &= (uint8_t) ~(1 << SREG_I))
+
+#endif  // SHIM_AVR_INTERRUPT_H
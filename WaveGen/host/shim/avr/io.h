@@ -0,0 +1,307 @@
+/*
+ *  Title: Host shim for <avr/io.h>
+ *  File : io.h
+ *  Target : Linux host builds of the firmware
+ *
+ *  The ATmega328P registers the firmware uses, as plain memory. 8 bit
+ *  registers live at their data space address in shim_io, 16 bit ones in
+ *  shim_io16. Storage is in shim_io.c.
+ */
+#ifndef SHIM_AVR_IO_H
+#define SHIM_AVR_IO_H
+
+#include <stdint.h>
+
+extern volatile uint8_t shim_io[256];
+extern volatile uint16_t shim_io16[8];
+
+#define _R(addr) (shim_io[addr])
+
+//  registers
+#define PINB _R(0x23)
+#define DDRB _R(0x24)
+#define PORTB _R(0x25)
+#define PINC _R(0x26)
+#define DDRC _R(0x27)
+#define PORTC _R(0x28)
+#define PIND _R(0x29)
+#define DDRD _R(0x2A)
+#define PORTD _R(0x2B)
+#define TIFR0 _R(0x35)
+#define TIFR1 _R(0x36)
+#define TIFR2 _R(0x37)
+#define PCIFR _R(0x3B)
+#define EIFR _R(0x3C)
+#define EIMSK _R(0x3D)
+#define GPIOR0 _R(0x3E)
+#define EECR _R(0x3F)
+#define EEDR _R(0x40)
+#define EEARL _R(0x41)
+#define EEARH _R(0x42)
+#define GPIOR1 _R(0x4A)
+#define GPIOR2 _R(0x4B)
+#define TCCR0A _R(0x44)
+#define TCCR0B _R(0x45)
+#define TCNT0 _R(0x46)
+#define OCR0A _R(0x47)
+#define OCR0B _R(0x48)
+#define SMCR _R(0x53)
+#define MCUSR _R(0x54)
+#define MCUCR _R(0x55)
+#define SREG _R(0x5F)
+#define WDTCSR _R(0x60)
+#define CLKPR _R(0x61)
+#define PRR _R(0x64)
+#define PCICR _R(0x68)
+#define EICRA _R(0x69)
+#define PCMSK0 _R(0x6B)
+#define PCMSK1 _R(0x6C)
+#define PCMSK2 _R(0x6D)
+#define TIMSK0 _R(0x6E)
+#define TIMSK1 _R(0x6F)
+#define TIMSK2 _R(0x70)
+#define ADCL _R(0x78)
+#define ADCH _R(0x79)
+#define ADCSRA _R(0x7A)
+#define ADCSRB _R(0x7B)
+#define ADMUX _R(0x7C)
+#define DIDR0 _R(0x7E)
+#define TCCR1A _R(0x80)
+#define TCCR1B _R(0x81)
+#define TCCR1C _R(0x82)
+#define TCCR2A _R(0xB0)
+#define TCCR2B _R(0xB1)
+#define TCNT2 _R(0xB2)
+#define OCR2A _R(0xB3)
+#define OCR2B _R(0xB4)
+#define TWBR _R(0xB8)
+#define TWSR _R(0xB9)
+#define TWAR _R(0xBA)
+#define TWDR _R(0xBB)
+#define UCSR0A _R(0xC0)
+#define UCSR0B _R(0xC1)
+#define UCSR0C _R(0xC2)
+#define UBRR0L _R(0xC4)
+#define UBRR0H _R(0xC5)
+#define TCNT1 (shim_io16[0])
+#define OCR1A (shim_io16[1])
+#define OCR1B (shim_io16[2])
+#define ICR1 (shim_io16[3])
+#define ADC (shim_io16[4])
+#define ADCW ADC
+#define EEAR (shim_io16[5])
+#define TWCR (shim_io16[6])  // bit 8 set by the emulator, see emu.c
+#define UDR0 (shim_io16[7])  // 16 bit so a write can be detected
+
+//  register bits
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PC6 6
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+#define PORTB0 0
+#define PORTB1 1
+#define PORTB2 2
+#define PORTB3 3
+#define PORTB4 4
+#define PORTB5 5
+#define PORTB6 6
+#define PORTB7 7
+#define PORTC0 0
+#define PORTC1 1
+#define PORTC2 2
+#define PORTC3 3
+#define PORTC4 4
+#define PORTC5 5
+#define PORTD0 0
+#define PORTD1 1
+#define PORTD2 2
+#define PORTD3 3
+#define PORTD4 4
+#define PORTD5 5
+#define PORTD6 6
+#define PORTD7 7
+#define DDB0 0
+#define DDB1 1
+#define DDB2 2
+#define DDB3 3
+#define DDB4 4
+#define DDB5 5
+#define DDB6 6
+#define DDB7 7
+#define DDC0 0
+#define DDC1 1
+#define DDC2 2
+#define DDC3 3
+#define DDC4 4
+#define DDC5 5
+#define DDD0 0
+#define DDD1 1
+#define DDD2 2
+#define DDD3 3
+#define DDD4 4
+#define DDD5 5
+#define DDD6 6
+#define DDD7 7
+#define COM0A1 7
+#define COM0A0 6
+#define COM0B1 5
+#define COM0B0 4
+#define WGM01 1
+#define WGM00 0
+#define FOC0A 7
+#define FOC0B 6
+#define WGM02 3
+#define CS02 2
+#define CS01 1
+#define CS00 0
+#define OCIE0B 2
+#define OCIE0A 1
+#define TOIE0 0
+#define OCF0B 2
+#define OCF0A 1
+#define TOV0 0
+#define COM1A1 7
+#define COM1A0 6
+#define WGM11 1
+#define WGM10 0
+#define ICNC1 7
+#define ICES1 6
+#define WGM13 4
+#define WGM12 3
+#define CS12 2
+#define CS11 1
+#define CS10 0
+#define ICIE1 5
+#define OCIE1B 2
+#define OCIE1A 1
+#define TOIE1 0
+#define OCF1A 1
+#define COM2A1 7
+#define COM2A0 6
+#define WGM21 1
+#define WGM20 0
+#define CS22 2
+#define CS21 1
+#define CS20 0
+#define OCIE2A 1
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+#define TWPS1 1
+#define TWPS0 0
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define FE0 4
+#define DOR0 3
+#define UPE0 2
+#define U2X0 1
+#define MPCM0 0
+#define RXCIE0 7
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ02 2
+#define UMSEL01 7
+#define UMSEL00 6
+#define UPM01 5
+#define UPM00 4
+#define USBS0 3
+#define UCSZ01 2
+#define UCSZ00 1
+#define UCPOL0 0
+#define REFS1 7
+#define REFS0 6
+#define ADLAR 5
+#define MUX3 3
+#define MUX2 2
+#define MUX1 1
+#define MUX0 0
+#define ADEN 7
+#define ADSC 6
+#define ADATE 5
+#define ADIF 4
+#define ADIE 3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+#define ACME 6
+#define ADTS2 2
+#define ADTS1 1
+#define ADTS0 0
+#define ADC0D 0
+#define ISC11 3
+#define ISC10 2
+#define ISC01 1
+#define ISC00 0
+#define INT1 1
+#define INT0 0
+#define INTF1 1
+#define INTF0 0
+#define SM2 3
+#define SM1 2
+#define SM0 1
+#define SE 0
+#define WDRF 3
+#define BORF 2
+#define EXTRF 1
+#define PORF 0
+#define WDIF 7
+#define WDIE 6
+#define WDP3 5
+#define WDCE 4
+#define WDE 3
+#define WDP2 2
+#define WDP1 1
+#define WDP0 0
+#define SREG_I 7
+#define EERE 0
+#define EEPE 1
+#define EEMPE 2
+#define PRADC 0
+#define _BV(b) (1 << (b))
+#define bit_is_set(r, b) ((r) & _BV(b))
+#define bit_is_clear(r, b) (!((r) & _BV(b)))
+#define loop_until_bit_is_set(r, b) do { } while (bit_is_clear(r, b))
+#define E2END 0x3FF
+#define RAMEND 0x8FF
+
+//  interrupt vectors, each ISR becomes a function of this name
+#define TIMER0_COMPA_vect shim_vect_timer0_compa
+#define TIMER0_COMPB_vect shim_vect_timer0_compb
+#define TIMER1_COMPA_vect shim_vect_timer1_compa
+#define TIMER2_COMPA_vect shim_vect_timer2_compa
+#define USART_RX_vect shim_vect_usart_rx
+#define USART_UDRE_vect shim_vect_usart_udre
+#define TWI_vect shim_vect_twi
+#define ADC_vect shim_vect_adc
+#define INT0_vect shim_vect_int0
+#define INT1_vect shim_vect_int1
+#define WDT_vect shim_vect_wdt
+#define BADISR_vect shim_vect_bad
+
+#endif  // SHIM_AVR_IO_H
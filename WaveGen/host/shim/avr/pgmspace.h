@@ -0,0 +1,22 @@
+/*
+ *  Title: Host shim for <avr/pgmspace.h>
+ *  File : pgmspace.h
+ *  Target : Linux host builds of the firmware headers
+ */
+#ifndef SHIM_AVR_PGMSPACE_H
+#define SHIM_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+//  flash and RAM share one address space on the host
+#define PROGMEM
+#define PGM_P const char *
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *) (addr))
+#define pgm_read_word(addr) (*(const uint16_t *) (addr))
+#define pgm_read_dword(addr) (*(const uint32_t *) (addr))
+#define memcpy_P memcpy
+#define strlen_P strlen
+
+#endif  // SHIM_AVR_PGMSPACE_H
@@ -0,0 +1,16 @@
+/*
+ *  Title: Host shim for <avr/sleep.h>
+ *  File : sleep.h
+ *  Target : Linux host builds of the firmware
+ */
+#ifndef SHIM_AVR_SLEEP_H
+#define SHIM_AVR_SLEEP_H
+
+//  the emulator's HAL_IDLE() stands in for sleeping, these do nothing
+#define SLEEP_MODE_IDLE 0
+#define set_sleep_mode(mode) ((void) (mode))
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu()
+
+#endif  // SHIM_AVR_SLEEP_H
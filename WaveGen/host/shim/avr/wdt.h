@@ -0,0 +1,25 @@
+/*
+ *  Title: Host shim for <avr/wdt.h>
+ *  File : wdt.h
+ *  Target : Linux host builds of the firmware
+ */
+#ifndef SHIM_AVR_WDT_H
+#define SHIM_AVR_WDT_H
+
+#include <avr/io.h>
+
+//  the emulator has no watchdog, WDTCSR is kept so the firmware's own
+//  bit handling still works
+#define WDTO_15MS 0
+#define WDTO_30MS 1
+#define WDTO_60MS 2
+#define WDTO_120MS 3
+#define WDTO_250MS 4
+#define WDTO_500MS 5
+#define WDTO_1S 6
+#define WDTO_2S 7
+#define wdt_reset()
+#define wdt_enable(timeout) (WDTCSR = (1 << WDE) | (timeout))
+#define wdt_disable() (WDTCSR = 0)
+
+#endif  // SHIM_AVR_WDT_H
@@ -0,0 +1,29 @@
+/*
+ *  Title: Host hooks for the firmware
+ *  File : hal_host.h
+ *  Target : Linux host builds of the firmware
+ *
+ *  Force included (-include hal_host.h) when main.c is built for the
+ *  emulator. The firmware calls HAL_IDLE() where it would sleep until
+ *  an interrupt; on the host that is where virtual time passes and the
+ *  ISRs run.
+ */
+#ifndef HAL_HOST_H
+#define HAL_HOST_H
+
+//  glibc and ASF compiler.h both define __always_inline; give it ASF's
+//  definition up front so the two agree
+#include <sys/cdefs.h>
+#undef __always_inline
+#define __always_inline inline __attribute__((__always_inline__))
+
+//  run the peripherals up to the next event
+void HalIdle(void);
+
+//  run the peripherals for a number of microseconds
+void HalDelayUs(double us);
+
+//  like sleeping on the AVR, interrupts are enabled first
+#define HAL_IDLE() do { sei(); HalIdle(); } while (0)
+
+#endif  // HAL_HOST_H
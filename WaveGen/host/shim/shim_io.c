@@ -0,0 +1,9 @@
+/*
+ *  Title: Host shim register storage
+ *  File : shim_io.c
+ *  Target : Linux host builds of the firmware
+ */
+#include <avr/io.h>
+
+volatile uint8_t shim_io[256];
+volatile uint16_t shim_io16[8];
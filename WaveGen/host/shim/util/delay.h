@@ -0,0 +1,15 @@
+/*
+ *  Title: Host shim for <util/delay.h>
+ *  File : delay.h
+ *  Target : Linux host builds of the firmware
+ */
+#ifndef SHIM_UTIL_DELAY_H
+#define SHIM_UTIL_DELAY_H
+
+#include "hal_host.h"
+
+//  delays move the emulator's virtual clock on
+#define _delay_us(us) HalDelayUs(us)
+#define _delay_ms(ms) HalDelayUs((ms)*1000.0)
+
+#endif  // SHIM_UTIL_DELAY_H
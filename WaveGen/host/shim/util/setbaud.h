@@ -0,0 +1,14 @@
+/*
+ *  Title: Host shim for <util/setbaud.h>
+ *  File : setbaud.h
+ *  Target : Linux host builds of the firmware
+ */
+#ifndef SHIM_UTIL_SETBAUD_H
+#define SHIM_UTIL_SETBAUD_H
+
+#define UBRR_VALUE (((F_CPU) + 8UL*(BAUD))/(16UL*(BAUD)) - 1UL)
+#define UBRRL_VALUE (UBRR_VALUE & 0xff)
+#define UBRRH_VALUE (UBRR_VALUE >> 8)
+#define USE_2X 0
+
+#endif  // SHIM_UTIL_SETBAUD_H
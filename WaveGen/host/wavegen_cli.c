@@ -0,0 +1,210 @@
+/*
+ *  Title: WaveGen command line client
+ *  File : wavegen_cli.c
+ *  Target : Linux host
+ *
+ *  Sends commands to the board, pipelining up to a window of them, and
+ *  prints each reply with its round-trip time, then the throughput.
+ *
+ *    wavegen_cli -p /dev/ttyUSB0 "AM1 01.50" "FR1 01000" CONTINUEE
+ *    wavegen_cli -p /dev/ttyUSB0 -w 1 < commands.txt
+ *
+ *  Commands come from the arguments, or one per line from stdin. The
+ *  trailing '!' is optional. Commands are tagged with a sequence number
+ *  unless -u is given, for firmware that does not echo tags.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wavegen_link.h"
+
+#define MAX_COMMANDS 4096
+
+static const char *status_names[] = {"ACK", "ERR", "DATA", "TIMEOUT"};
+
+/**
+ * \brief Print a temperature line from the board
+ */
+static void PrintTemperature(const char *line, void *context) {
+    int *quiet = context;
+
+    if (!*quiet) {
+        printf("temp %s\n", line);
+    }
+}
+
+/**
+ * \brief Print the records of a LOG! reply, one per line
+ */
+static void PrintLog(const char *line) {
+    static LinkLogRecord records[LINK_REPLY_MAX/10];
+    LinkLogHeader header;
+    int count = LinkDecodeLog(line, &header, records,
+                              sizeof(records)/sizeof(records[0]));
+
+    if (count < 0) {
+        printf("log: bad frame\n");
+        return;
+    }
+    printf("log %u records, %u lost\n", header.count, header.lost);
+    for (int i = 0; i < count; i++) {
+        printf("log %10.1f s  sensor %d  %7.2f degC\n",
+               records[i].tick*(header.tick_us*1e-6), records[i].sensor,
+               records[i].celsius);
+    }
+}
+
+static void Usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-p port] [-w window] [-t timeout] [-u] [-q] "
+            "[command ...]\n"
+            "  -p port     serial port or pty (default /dev/ttyUSB0)\n"
+            "  -w window   commands sent ahead of their replies (default 4)\n"
+            "  -t timeout  seconds to wait for each reply (default 2)\n"
+            "  -u          untagged, match replies by order only\n"
+            "  -q          only print the summary\n",
+            name);
+}
+
+/**
+ * \brief Read commands from stdin, one per line
+ */
+static int ReadCommands(char **commands, int max) {
+    char line[LINK_LINE_MAX];
+    int count = 0;
+
+    while (count < max && fgets(line, sizeof(line), stdin) != NULL) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (line[0] != 0 && line[0] != '#') {
+            commands[count++] = strdup(line);
+        }
+    }
+    return count;
+}
+
+int main(int argc, char **argv) {
+    const char *port = "/dev/ttyUSB0";
+    int window = 4;
+    double timeout = 2.0;
+    int quiet = 0;
+    int tagged = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:w:t:uqh")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = optarg;
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 't':
+            timeout = atof(optarg);
+            break;
+        case 'u':
+            tagged = 0;
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        default:
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    if (window < 1 || window > LINK_MAX_PENDING || timeout <= 0) {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    static char *commands[MAX_COMMANDS];
+    int total;
+    if (optind < argc) {
+        total = argc - optind;
+        if (total > MAX_COMMANDS) {
+            total = MAX_COMMANDS;
+        }
+        memcpy(commands, &argv[optind], total*sizeof(char *));
+    } else {
+        total = ReadCommands(commands, MAX_COMMANDS);
+    }
+
+    WaveGenLink link;
+    if (LinkOpen(&link, port, B9600) != 0) {
+        perror(port);
+        return 1;
+    }
+    link.window = window;
+    link.timeout = timeout;
+    link.tagged = tagged;
+    LinkSetTelemetry(&link, PrintTemperature, &quiet);
+
+    int sent = 0;
+    int done = 0;
+    int counts[4] = {0};
+    double rtt_min = 0;
+    double rtt_max = 0;
+    double rtt_sum = 0;
+    double start = LinkNow();
+
+    while (done < total) {
+        LinkReply reply;
+
+        //  keep the window full
+        while (sent < total && LinkCanSend(&link)) {
+            if (LinkSend(&link, commands[sent]) != 0) {
+                perror("write");
+                return 1;
+            }
+            sent++;
+        }
+
+        int got = LinkPoll(&link, &reply, 100);
+        if (got < 0) {
+            perror("read");
+            return 1;
+        }
+        if (got == 0) {
+            continue;
+        }
+
+        done++;
+        counts[reply.status]++;
+        if (reply.status != LINK_TIMEOUT) {
+            if (rtt_sum == 0 || reply.rtt < rtt_min) {
+                rtt_min = reply.rtt;
+            }
+            if (reply.rtt > rtt_max) {
+                rtt_max = reply.rtt;
+            }
+            rtt_sum += reply.rtt;
+        }
+        if (!quiet) {
+            printf("%-12s %-7s %7.1f ms  %s\n", reply.command,
+                   status_names[reply.status], reply.rtt*1e3, reply.line);
+            if (reply.status == LINK_DATA &&
+                strncmp(reply.line, "TL ", 3) == 0) {
+                PrintLog(reply.line);
+            }
+        }
+    }
+
+    double elapsed = LinkNow() - start;
+    int answered = total - counts[LINK_TIMEOUT];
+    printf("%d commands in %.3f s: %.1f commands/s, %.0f bytes/s out, "
+           "%.0f bytes/s in\n", total, elapsed,
+           elapsed > 0 ? total/elapsed : 0,
+           elapsed > 0 ? link.bytes_out/elapsed : 0,
+           elapsed > 0 ? link.bytes_in/elapsed : 0);
+    printf("%d ACK, %d ERR, %d data, %d timeout; rtt min/avg/max "
+           "%.1f/%.1f/%.1f ms\n", counts[LINK_ACK], counts[LINK_ERR],
+           counts[LINK_DATA], counts[LINK_TIMEOUT], rtt_min*1e3,
+           answered > 0 ? rtt_sum/answered*1e3 : 0, rtt_max*1e3);
+
+    LinkClose(&link);
+    return counts[LINK_ERR] + counts[LINK_TIMEOUT] > 0;
+}
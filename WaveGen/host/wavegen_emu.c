@@ -0,0 +1,180 @@
+/*
+ *  Title: WaveGen device emulator
+ *  File : wavegen_emu.c
+ *  Target : Linux host
+ *
+ *  Runs the firmware from main.c on the emulator core and connects its
+ *  UART to a pseudo-terminal, so host tools can be tested without a
+ *  board:
+ *
+ *    wavegen_emu -s 10 -l /tmp/wavegen &
+ *    wavegen_cli -p /tmp/wavegen "FR1 01000" RATE CONTINUEE
+ *
+ *  The pty path is printed on the first line of stdout.
+ */
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "emu.h"
+
+int firmware_main(void);
+
+#define XON 0x11
+#define XOFF 0x13
+
+//  the pty and the bytes read from it but not yet given to the board
+typedef struct {
+    int master;
+    uint8_t rx[256];
+    int rx_len;
+    int rx_pos;
+    int paused;  //  the board sent XOFF
+} Pty;
+
+/**
+ * \brief Next byte from the host, -1 if there is none
+ */
+static int PtyRead(void *context) {
+    Pty *pty = context;
+
+    //  a serial adapter stops within a byte of XOFF, the pty does not
+    if (pty->paused) {
+        return -1;
+    }
+    if (pty->rx_pos == pty->rx_len) {
+        ssize_t got = read(pty->master, pty->rx, sizeof(pty->rx));
+        if (got <= 0) {
+            return -1;
+        }
+        pty->rx_len = got;
+        pty->rx_pos = 0;
+    }
+    return pty->rx[pty->rx_pos++];
+}
+
+/**
+ * \brief Byte from the board to the host, dropped if nobody is reading
+ */
+static void PtyWrite(uint8_t byte, void *context) {
+    Pty *pty = context;
+
+    //  replies are all text, any 0x11/0x13 is flow control
+    if (byte == XOFF || byte == XON) {
+        pty->paused = (byte == XOFF);
+    }
+    if (write(pty->master, &byte, 1) < 0 && errno != EAGAIN) {
+        perror("pty");
+        exit(1);
+    }
+}
+
+/**
+ * \brief Open a pty with a raw slave side
+ * \retval master fd, -1 on failure
+ */
+static int OpenPty(char *name, size_t size) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        return -1;
+    }
+    snprintf(name, size, "%s", ptsname(master));
+
+    //  keep the slave open so the pty lives between clients, and raw so
+    //  nothing is echoed or translated before a client sets it up
+    int slave = open(name, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if (slave < 0 || tcgetattr(slave, &tio) != 0) {
+        return -1;
+    }
+    cfmakeraw(&tio);
+    tio.c_iflag |= IXON;
+    tcsetattr(slave, TCSANOW, &tio);
+
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    return master;
+}
+
+static void Usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-s speed] [-a addr[,addr...]] [-T celsius] [-l link]\n"
+            "  -s speed    virtual seconds per real second, 0 for flat out "
+            "(default 1)\n"
+            "  -a addrs    hex I2C addresses of the temp sensors "
+            "(default 48, '-' for none)\n"
+            "  -T celsius  temperature the sensors read (default 23)\n"
+            "  -l link     also make a symlink to the pty here\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    EmuHooks hooks = {1.0, 9600, PtyWrite, PtyRead, NULL, NULL};
+    const char *addresses = "48";
+    const char *link = NULL;
+    double celsius = 23.0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:a:T:l:h")) != -1) {
+        switch (opt) {
+        case 's':
+            hooks.speed = atof(optarg);
+            break;
+        case 'a':
+            addresses = optarg;
+            break;
+        case 'T':
+            celsius = atof(optarg);
+            break;
+        case 'l':
+            link = optarg;
+            break;
+        default:
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+
+    Pty pty = {0};
+    char name[64];
+    pty.master = OpenPty(name, sizeof(name));
+    if (pty.master < 0) {
+        perror("pty");
+        return 1;
+    }
+    if (link != NULL) {
+        unlink(link);
+        if (symlink(name, link) != 0) {
+            perror(link);
+            return 1;
+        }
+    }
+    printf("%s\n", name);
+    fflush(stdout);
+
+    hooks.context = &pty;
+    EmuInit(&hooks);
+    if (strcmp(addresses, "-") != 0) {
+        const char *next = addresses;
+        while (*next != 0) {
+            char *end;
+            long addr = strtol(next, &end, 16);
+            if (end == next || addr < 0x08 || addr > 0x77 ||
+                EmuAddSensor(addr, celsius) != 0) {
+                Usage(argv[0]);
+                return 2;
+            }
+            next = (*end == ',') ? end + 1 : end;
+        }
+    }
+
+    EmuRun(firmware_main);
+    return 0;
+}
@@ -0,0 +1,358 @@
+/*
+ *  Title: WaveGen serial link
+ *  File : wavegen_link.c
+ *  Target : Linux host
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wavegen_link.h"
+
+double LinkNow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int LinkOpen(WaveGenLink *link, const char *path, speed_t speed) {
+    struct termios tio;
+
+    memset(link, 0, sizeof(*link));
+    link->window = 4;
+    link->timeout = 2.0;
+    link->tagged = 1;
+    link->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (link->fd < 0) {
+        return -1;
+    }
+    if (tcgetattr(link->fd, &tio) != 0) {
+        close(link->fd);
+        return -1;
+    }
+
+    //  raw 8N1, the board pauses us with XOFF when it falls behind; its
+    //  replies are all text, so no data byte is taken for XON/XOFF
+    cfmakeraw(&tio);
+    tio.c_iflag |= IXON;
+    tio.c_cflag |= CLOCAL | CREAD;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    if (tcsetattr(link->fd, TCSANOW, &tio) != 0) {
+        close(link->fd);
+        return -1;
+    }
+    tcflush(link->fd, TCIOFLUSH);
+    return 0;
+}
+
+void LinkClose(WaveGenLink *link) {
+    if (link->fd >= 0) {
+        close(link->fd);
+        link->fd = -1;
+    }
+}
+
+void LinkSetTelemetry(WaveGenLink *link, LinkTelemetry telemetry,
+                      void *context) {
+    link->telemetry = telemetry;
+    link->context = context;
+}
+
+int LinkCanSend(const WaveGenLink *link) {
+    return link->count < link->window && link->count < LINK_MAX_PENDING;
+}
+
+int LinkPending(const WaveGenLink *link) {
+    return link->count;
+}
+
+/**
+ * \brief Write all of a buffer to the non-blocking port
+ */
+static int WriteAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+int LinkSend(WaveGenLink *link, const char *command) {
+    char line[LINK_LINE_MAX];
+    size_t len = strlen(command);
+    size_t start = 0;
+    unsigned tag = link->seq;
+
+    if (!LinkCanSend(link) || len == 0 || len + 8 > sizeof(line)) {
+        return -1;
+    }
+    if (link->tagged) {
+        //  the board keeps REPLY_TAG_MAX (4) tag bytes, "#999", and answers
+        //  a longer tag with a bare ERR, so tags wrap at LINK_TAG_LIMIT
+        start = sprintf(line, "#%u ", tag);
+        link->seq = (tag + 1) % LINK_TAG_LIMIT;
+    }
+    memcpy(line + start, command, len);
+    len += start;
+    if (line[len - 1] != '!') {
+        line[len++] = '!';
+    }
+    line[len] = 0;
+
+    if (WriteAll(link->fd, line, len) != 0) {
+        return -1;
+    }
+    link->bytes_out += len;
+
+    LinkPendingCommand *pending =
+        &link->pending[(link->head + link->count) % LINK_MAX_PENDING];
+    memcpy(pending->command, line + start, len - start + 1);
+    pending->tag = tag;
+    pending->sent = LinkNow();
+    link->count++;
+    return 0;
+}
+
+/**
+ * \brief Check if a line is a temperature reading rather than a reply
+ *
+ * Readings start with a digit, a minus sign or "--" (no reading);
+ * replies always start with a letter.
+ */
+static int IsTelemetry(const char *line) {
+    return isdigit((unsigned char) line[0]) || line[0] == '-';
+}
+
+/**
+ * \brief Take the oldest pending command off the queue into reply
+ */
+static void PopPending(WaveGenLink *link, LinkReply *reply, double now) {
+    LinkPendingCommand *pending = &link->pending[link->head];
+
+    snprintf(reply->command, sizeof(reply->command), "%s", pending->command);
+    reply->rtt = now - pending->sent;
+    link->head = (link->head + 1) % LINK_MAX_PENDING;
+    link->count--;
+}
+
+/**
+ * \brief Take one complete line out of the receive buffer
+ * \retval 1 if line was filled in, 0 if no full line is buffered
+ */
+static int TakeLine(WaveGenLink *link, char *line) {
+    if (link->held[0] != 0) {
+        memcpy(line, link->held, sizeof(link->held));
+        link->held[0] = 0;
+        return 1;
+    }
+
+    char *end = memchr(link->rx, '\n', link->rx_len);
+
+    if (end == NULL) {
+        if (link->rx_len == sizeof(link->rx)) {
+            //  no newline in a full buffer, hand it over as a line
+            end = link->rx + link->rx_len - 1;
+        } else {
+            return 0;
+        }
+    }
+
+    size_t len = end - link->rx;
+    memcpy(line, link->rx, len);
+    line[len] = 0;
+    if (len > 0 && line[len - 1] == '\r') {
+        line[len - 1] = 0;
+    }
+    link->rx_len -= len + 1;
+    memmove(link->rx, end + 1, link->rx_len);
+    return 1;
+}
+
+int LinkPoll(WaveGenLink *link, LinkReply *reply, int timeout_ms) {
+    double deadline = LinkNow() + timeout_ms/1000.0;
+    char line[LINK_REPLY_MAX];
+
+    for (;;) {
+        while (TakeLine(link, line)) {
+            if (line[0] == 0) {
+                continue;
+            }
+            const char *text = line;
+            if (link->tagged && line[0] == '#') {
+                //  find the command the tag belongs to
+                char *end;
+                unsigned tag = strtoul(line + 1, &end, 10);
+                int age = 0;
+                while (age < link->count && link->pending[
+                       (link->head + age) % LINK_MAX_PENDING].tag != tag) {
+                    age++;
+                }
+                if (age == link->count) {
+                    //  reply to a command that already timed out
+                    continue;
+                }
+                if (age > 0) {
+                    //  the oldest command's reply was lost, report it and
+                    //  keep this reply for the next call
+                    memcpy(link->held, line, sizeof(link->held));
+                    PopPending(link, reply, LinkNow());
+                    reply->line[0] = 0;
+                    reply->status = LINK_TIMEOUT;
+                    reply->error = 0;
+                    return 1;
+                }
+                text = (*end == ' ') ? end + 1 : end;
+            } else if (link->tagged || IsTelemetry(line) || link->count == 0) {
+                if (link->telemetry != NULL) {
+                    link->telemetry(line, link->context);
+                }
+                continue;
+            }
+
+            PopPending(link, reply, LinkNow());
+            snprintf(reply->line, sizeof(reply->line), "%s", text);
+            reply->error = 0;
+            if (strcmp(text, "ACK") == 0) {
+                reply->status = LINK_ACK;
+            } else if (strncmp(text, "ERR", 3) == 0) {
+                reply->status = LINK_ERR;
+                reply->error = atoi(text + 3);
+            } else {
+                reply->status = LINK_DATA;
+            }
+            return 1;
+        }
+
+        //  wait for more data, the deadline or the oldest reply's timeout
+        double now = LinkNow();
+        double wait = deadline - now;
+        if (link->count > 0) {
+            double overdue = link->pending[link->head].sent + link->timeout;
+            if (now >= overdue) {
+                PopPending(link, reply, now);
+                reply->line[0] = 0;
+                reply->status = LINK_TIMEOUT;
+                reply->error = 0;
+                return 1;
+            }
+            if (overdue - now < wait) {
+                wait = overdue - now;
+            }
+        }
+        if (wait < 0) {
+            return 0;
+        }
+
+        struct pollfd pfd = {link->fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, (int) (wait*1000) + 1);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ready == 0) {
+            continue;
+        }
+
+        ssize_t got = read(link->fd, link->rx + link->rx_len,
+                           sizeof(link->rx) - link->rx_len);
+        if (got < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (got == 0) {
+            return -1;
+        }
+        link->rx_len += got;
+        link->bytes_in += got;
+    }
+}
+
+#define LOG_HEADER_SIZE 12  // bytes ahead of the records in a LOG! frame
+#define LOG_RECORD_SIZE 5
+
+static int HexDigit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static unsigned long Le(const unsigned char *data, int bytes) {
+    unsigned long value = 0;
+
+    while (bytes-- > 0) {
+        value = value << 8 | data[bytes];
+    }
+    return value;
+}
+
+int LinkDecodeLog(const char *line, LinkLogHeader *header,
+                  LinkLogRecord *records, int max) {
+    unsigned char frame[LINK_REPLY_MAX/2];
+    size_t len = 0;
+
+    if (strncmp(line, "TL ", 3) != 0) {
+        return -1;
+    }
+    for (const char *hex = line + 3; *hex != 0; hex += 2) {
+        int high = HexDigit(hex[0]);
+        int low = high < 0 ? -1 : HexDigit(hex[1]);
+        if (low < 0 || len == sizeof(frame)) {
+            return -1;
+        }
+        frame[len++] = high << 4 | low;
+    }
+    if (len < LOG_HEADER_SIZE) {
+        return -1;
+    }
+
+    header->count = Le(frame, 2);
+    header->lost = Le(frame + 2, 2);
+    header->tick_us = Le(frame + 4, 4);
+    header->now = Le(frame + 8, 4);
+    if (len != LOG_HEADER_SIZE + header->count*LOG_RECORD_SIZE) {
+        return -1;
+    }
+
+    int count = 0;
+    for (; count < (int) header->count && count < max; count++) {
+        const unsigned char *record = frame + LOG_HEADER_SIZE +
+                                      count*LOG_RECORD_SIZE;
+        unsigned tick = Le(record, 2);
+
+        //  the board sends the low word of the tick count
+        records[count].tick = header->now - ((header->now - tick) & 0xFFFF);
+        records[count].celsius = (int16_t) Le(record + 2, 2)/256.0;
+        records[count].sensor = record[4];
+    }
+    return count;
+}
@@ -0,0 +1,164 @@
+/*
+ *  Title: WaveGen serial link
+ *  File : wavegen_link.h
+ *  Target : Linux host
+ *
+ *  Talks to the board (or anything speaking its protocol on a
+ *  pseudo-terminal) over a serial port. Commands can be pipelined: up to
+ *  a window of them are sent before the first reply arrives, and replies
+ *  are matched to commands in order, since the firmware answers every
+ *  command with exactly one line. Temperature lines, which the board
+ *  sends on its own, are passed to a callback instead.
+ *
+ *  By default every command is sent tagged, "#<seq> AM1 01.50!", and the
+ *  board echoes the tag: "#<seq> ACK" or "#<seq> ERR <code>". A lost reply
+ *  then only costs its own command. Untagged, a reply that never comes
+ *  shifts the matching by one until that command times out.
+ */
+#ifndef WAVEGEN_LINK_H_INCLUDED
+#define WAVEGEN_LINK_H_INCLUDED
+
+#include <stddef.h>
+#include <termios.h>
+
+#define LINK_LINE_MAX 128  // longest command line
+#define LINK_REPLY_MAX 1536  // longest reply line, a full LOG! frame in hex
+#define LINK_MAX_PENDING 16  // most commands waiting for a reply
+#define LINK_TAG_LIMIT 1000  // tags run from 0 to 999, the board rejects 4 digits
+
+typedef enum {
+    LINK_ACK,  // "ACK"
+    LINK_ERR,  // "ERR"
+    LINK_DATA,  // any other reply, e.g. the RATE! or STATS! report
+    LINK_TIMEOUT  // no reply within the timeout
+} LinkStatus;
+
+// the reply to one command
+typedef struct {
+    char command[LINK_LINE_MAX];
+    char line[LINK_REPLY_MAX];  // reply without the newline, empty on timeout
+    LinkStatus status;
+    int error;  // code after a tagged ERR, 0 otherwise
+    double rtt;  // seconds from writing the command to reading the reply
+} LinkReply;
+
+// header of a LOG! reply, "TL <hex>"
+typedef struct {
+    unsigned count;  // records in the reply
+    unsigned lost;  // records the board overwrote since the last LOG!
+    unsigned long tick_us;  // length of one log tick in microseconds
+    unsigned long now;  // tick count when the log was sent
+} LinkLogHeader;
+
+// one temperature log record
+typedef struct {
+    unsigned long tick;  // tick of the reading, unwrapped against now
+    double celsius;
+    int sensor;  // index of the sensor in the SCAN! order
+} LinkLogRecord;
+
+// called with every temperature line, without the newline
+typedef void (*LinkTelemetry)(const char *line, void *context);
+
+// a command that has been sent and not answered yet
+typedef struct {
+    char command[LINK_LINE_MAX];
+    unsigned tag;
+    double sent;
+} LinkPendingCommand;
+
+typedef struct {
+    int fd;
+    int window;  // commands in flight before LinkCanSend says no
+    double timeout;  // seconds to wait for each reply
+    int tagged;  // send "#<seq> " ahead of each command, on by default
+    unsigned seq;  // tag of the next command
+    LinkPendingCommand pending[LINK_MAX_PENDING];
+    int head;  // oldest pending command
+    int count;  // pending commands
+    char rx[LINK_REPLY_MAX];  // partial line read from the port
+    size_t rx_len;
+    char held[LINK_REPLY_MAX];  // reply put back while an older one is dropped
+    LinkTelemetry telemetry;
+    void *context;
+    unsigned long bytes_out;
+    unsigned long bytes_in;
+} WaveGenLink;
+
+/**
+ * \brief Open a serial port or pseudo-terminal
+ *
+ * The port is set to raw 8N1 at the given speed with XON/XOFF output
+ * flow control, which the firmware uses when its receive buffer fills.
+ *
+ * \param link the link to set up
+ * \param path device, e.g. /dev/ttyUSB0 or /dev/pts/3
+ * \param speed termios speed, e.g. B9600
+ * \retval 0 on success, -1 with errno set on failure
+ */
+int LinkOpen(WaveGenLink *link, const char *path, speed_t speed);
+
+/**
+ * \brief Close the port
+ */
+void LinkClose(WaveGenLink *link);
+
+/**
+ * \brief Set the function that gets temperature lines
+ */
+void LinkSetTelemetry(WaveGenLink *link, LinkTelemetry telemetry,
+                      void *context);
+
+/**
+ * \brief Check if another command fits in the window
+ */
+int LinkCanSend(const WaveGenLink *link);
+
+/**
+ * \brief Number of commands waiting for a reply
+ */
+int LinkPending(const WaveGenLink *link);
+
+/**
+ * \brief Send one command without waiting for its reply
+ *
+ * A missing trailing '!' is added.
+ *
+ * \retval 0 on success, -1 on a write error or a full window
+ */
+int LinkSend(WaveGenLink *link, const char *command);
+
+/**
+ * \brief Wait for the reply to the oldest pending command
+ *
+ * Temperature lines seen while waiting go to the telemetry callback.
+ * A command whose reply is overdue, or that a tagged reply to a later
+ * command overtook, is returned as LINK_TIMEOUT.
+ *
+ * \param reply filled in when a reply is returned
+ * \param timeout_ms longest wait, 0 to only take what is already there
+ * \retval 1 if a reply was returned, 0 if none yet, -1 on a read error
+ */
+int LinkPoll(WaveGenLink *link, LinkReply *reply, int timeout_ms);
+
+/**
+ * \brief Decode the reply to LOG!
+ *
+ * The frame is read field by field at fixed offsets, little endian: a 12
+ * byte header (count u16, lost u16, tick_us u32, now u32) and 5 bytes per
+ * record (tick u16, reading i16 in 1/256 degC, sensor u8).
+ *
+ * \param line the reply, "TL " and the frame in hex
+ * \param header filled in from the frame header
+ * \param records filled in with up to max records, oldest first
+ * \retval records decoded, -1 if line is not a complete LOG! reply
+ */
+int LinkDecodeLog(const char *line, LinkLogHeader *header,
+                  LinkLogRecord *records, int max);
+
+/**
+ * \brief Seconds on the monotonic clock
+ */
+double LinkNow(void);
+
+#endif /* WAVEGEN_LINK_H_INCLUDED */
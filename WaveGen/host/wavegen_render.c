@@ -0,0 +1,316 @@
+/*
+ *  Title: WaveGen output renderer
+ *  File : wavegen_render.c
+ *  Target : Linux host
+ *
+ *  Runs the firmware from main.c on the emulator core, sends it a
+ *  command sequence over the emulated UART and records the two ladder
+ *  outputs after every sample interrupt, as WAV or CSV:
+ *
+ *    wavegen_render -n 441000 -o sine.wav "FR1 01000" "AM1 02.00"
+ *    wavegen_render -f csv -n 1000 < commands.txt > samples.csv
+ *
+ *  Commands come from the arguments, or one per line from stdin, as for
+ *  wavegen_cli. CONTINUEE! is added if the last command is not one, and
+ *  recording starts with the first sample after the last command byte,
+ *  so the file holds exactly what the board would put out from then on.
+ *  The run goes on after the last sample until every command has its
+ *  reply, or for at most a second more.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "emu.h"
+
+int firmware_main(void);
+
+extern uint16_t sampling_frequency;  //  the firmware's sample rate
+
+#define MAX_INPUT 65536  // command bytes sent to the board
+#define XON 0x11
+#define XOFF 0x13
+
+enum {FORMAT_WAV, FORMAT_CSV};
+
+//  the run: command bytes still to send and the samples still to write
+typedef struct {
+    char input[MAX_INPUT];
+    size_t input_len;
+    size_t input_pos;
+    int paused;  //  the board sent XOFF
+    char line[2048];  //  reply being received, LOG! in hex is the longest
+    size_t line_len;
+    long commands;  //  commands sent, each gets one reply
+    long replies;
+    int errors;  //  ERR replies and missing ones
+    FILE *out;
+    int format;
+    long samples;  //  samples to record
+    long recorded;
+    long waited;  //  samples since the last one recorded
+    const char *last;  //  last command added
+} Render;
+
+/**
+ * \brief Next command byte for the board, -1 once they have all gone
+ */
+static int RenderRead(void *context) {
+    Render *render = context;
+
+    if (render->paused || render->input_pos == render->input_len) {
+        return -1;
+    }
+    return (uint8_t) render->input[render->input_pos++];
+}
+
+/**
+ * \brief Text after an optional "#<tag> " prefix
+ */
+static const char *SkipTag(const char *text) {
+    const char *space = strchr(text, ' ');
+
+    if (text[0] == '#' && space != NULL) {
+        return space + 1;
+    }
+    return text;
+}
+
+/**
+ * \brief Byte from the board, replies other than ACK go to stderr
+ */
+static void RenderWrite(uint8_t byte, void *context) {
+    Render *render = context;
+
+    //  replies are all text, binary frames come in hex, so these bytes are
+    //  only ever flow control
+    if (byte == XOFF || byte == XON) {
+        render->paused = (byte == XOFF);
+        return;
+    }
+    if (byte != '\n') {
+        if (render->line_len < sizeof(render->line) - 1) {
+            render->line[render->line_len++] = byte;
+        }
+        return;
+    }
+    render->line[render->line_len] = 0;
+    render->line_len = 0;
+    //  temperature readings start with a digit or '-', replies with a tag
+    //  or a letter
+    const char *reply = SkipTag(render->line);
+    if (reply[0] < 'A' || reply[0] > 'Z') {
+        return;
+    }
+    render->replies++;
+    if (strncmp(reply, "ERR", 3) == 0) {
+        render->errors++;
+    }
+    if (strcmp(reply, "ACK") != 0) {
+        fprintf(stderr, "%s\n", render->line);
+    }
+}
+
+static void PutLe(FILE *out, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        putc((value >> (8*i)) & 0xFF, out);
+    }
+}
+
+/**
+ * \brief RIFF header for 8 bit unsigned stereo, one channel per wave
+ */
+static void WriteWavHeader(FILE *out, uint32_t rate, uint32_t samples) {
+    fwrite("RIFF", 1, 4, out);
+    PutLe(out, 36 + 2*samples, 4);
+    fwrite("WAVEfmt ", 1, 8, out);
+    PutLe(out, 16, 4);  //  fmt chunk size
+    PutLe(out, 1, 2);  //  PCM
+    PutLe(out, 2, 2);  //  channels
+    PutLe(out, rate, 4);
+    PutLe(out, 2*rate, 4);  //  bytes per second
+    PutLe(out, 2, 2);  //  bytes per frame
+    PutLe(out, 8, 2);  //  bits per sample
+    fwrite("data", 1, 4, out);
+    PutLe(out, 2*samples, 4);
+}
+
+/**
+ * \brief After every sample interrupt, record the ladder outputs
+ */
+static void RenderSample(void *context) {
+    Render *render = context;
+
+    if (render->input_pos < render->input_len) {
+        //  still sending commands, the output is not the one asked for
+        return;
+    }
+    if (render->recorded == render->samples) {
+        //  all recorded, wait for the replies still on their way
+        if (render->replies >= render->commands) {
+            EmuStop();
+        } else if (++render->waited > sampling_frequency) {
+            fprintf(stderr, "no reply to %ld commands\n",
+                    render->commands - render->replies);
+            render->errors++;
+            EmuStop();
+        }
+        return;
+    }
+    if (render->recorded == 0) {
+        fprintf(stderr, "rate %u Hz\n", sampling_frequency);
+        if (render->format == FORMAT_WAV) {
+            WriteWavHeader(render->out, sampling_frequency, render->samples);
+        } else {
+            fprintf(render->out, "sample,wave1,wave2\n");
+        }
+    }
+
+    uint8_t one = EmuWaveOut(1);
+    uint8_t two = EmuWaveOut(2);
+    if (render->format == FORMAT_WAV) {
+        putc(one, render->out);
+        putc(two, render->out);
+    } else {
+        fprintf(render->out, "%ld,%u,%u\n", render->recorded, one, two);
+    }
+    if (++render->recorded == render->samples &&
+        render->replies >= render->commands) {
+        EmuStop();
+    }
+}
+
+/**
+ * \brief Add a command to the input, with its '!'
+ *
+ * Nothing goes between commands, any byte after CONTINUEE! would take
+ * the board back into command mode.
+ * \retval 0, or -1 if the input is full
+ */
+static int AddCommand(Render *render, const char *command) {
+    size_t len = strlen(command);
+    size_t room = sizeof(render->input) - render->input_len;
+
+    while (len > 0 && (command[len - 1] == '\n' || command[len - 1] == '\r')) {
+        len--;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (len + 1 > room) {
+        return -1;
+    }
+    render->last = render->input + render->input_len;
+    memcpy(render->input + render->input_len, command, len);
+    render->input_len += len;
+    if (command[len - 1] != '!') {
+        render->input[render->input_len++] = '!';
+    }
+    for (const char *c = render->last; c < render->input + render->input_len;
+         c++) {
+        render->commands += (*c == '!');
+    }
+    return 0;
+}
+
+static void Usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s [-n samples] [-f wav|csv] [-o file] [-t hz] "
+            "[command ...]\n"
+            "  -n samples  samples to record (default 44444)\n"
+            "  -f format   wav, 8 bit stereo, or csv (default wav)\n"
+            "  -o file     output file (default stdout)\n"
+            "  -t hz       master sample clock on T0, for CLK 2 (default none)\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    static Render render;
+    EmuHooks hooks = {0, 9600, RenderWrite, RenderRead, RenderSample, &render};
+    const char *path = NULL;
+    int opt;
+
+    render.format = FORMAT_WAV;
+    render.samples = 44444;
+    while ((opt = getopt(argc, argv, "n:f:o:t:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            render.samples = atol(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "wav") == 0) {
+                render.format = FORMAT_WAV;
+            } else if (strcmp(optarg, "csv") == 0) {
+                render.format = FORMAT_CSV;
+            } else {
+                Usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'o':
+            path = optarg;
+            break;
+        case 't':
+            hooks.t0_hz = atof(optarg);
+            break;
+        default:
+            Usage(argv[0]);
+            return 2;
+        }
+    }
+    if (render.samples <= 0) {
+        Usage(argv[0]);
+        return 2;
+    }
+
+    //  the commands, then CONTINUEE! to start the output
+    if (optind < argc) {
+        for (int i = optind; i < argc; i++) {
+            if (AddCommand(&render, argv[i]) != 0) {
+                fprintf(stderr, "too many commands\n");
+                return 2;
+            }
+        }
+    } else {
+        char line[256];
+        while (fgets(line, sizeof(line), stdin) != NULL) {
+            if (line[0] == '#') {
+                continue;
+            }
+            if (AddCommand(&render, line) != 0) {
+                fprintf(stderr, "too many commands\n");
+                return 2;
+            }
+        }
+    }
+    if (render.last == NULL ||
+        strncmp(SkipTag(render.last), "CONTINUEE", 9) != 0) {
+        if (AddCommand(&render, "CONTINUEE!") != 0) {
+            fprintf(stderr, "too many commands\n");
+            return 2;
+        }
+    }
+
+    render.out = stdout;
+    if (path != NULL) {
+        render.out = fopen(path, "wb");
+        if (render.out == NULL) {
+            perror(path);
+            return 1;
+        }
+    }
+    setvbuf(render.out, NULL, _IOFBF, 1 << 16);
+
+    //  no temperature sensors, the TWI would only slow the run down
+    EmuInit(&hooks);
+    EmuRun(firmware_main);
+
+    if (fclose(render.out) != 0) {
+        perror(path != NULL ? path : "stdout");
+        return 1;
+    }
+    return render.errors != 0;
+}